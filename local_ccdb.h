@@ -0,0 +1,148 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Directory-backed stand-in for the o2::ccdb::CcdbApi calls used by noisy_pixels_count.cxx
+// (offline tests and benchmarks). An object valid in [from, until] is stored as
+//   <dir>/<path>/<from>_<until>.root  (object under the key "ccdb_object", as in CCDB snapshots)
+//   <dir>/<path>/<from>_<until>.hdr   (headers, one "key<TAB>value" per line)
+// As in the CCDB, the object with the latest Valid-From wins if several are valid at a timestamp.
+
+#ifndef LOCAL_CCDB_H
+#define LOCAL_CCDB_H
+
+// cpp headers
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+// posix headers
+#include <dirent.h>
+// root headers
+#include "TSystem.h"
+#include "TFile.h"
+
+class local_ccdb
+{
+ public:
+  void init (const std::string& dir) { mDir = dir; }
+
+  std::map<std::string, std::string> retrieveHeaders (const std::string& path, 
+    const std::map<std::string, std::string>& /*filter*/, long ts = -1) const
+  {
+    std::string base = find_object(path, ts);
+    if (base.empty()) return {};
+    return read_headers(base);
+  }
+
+  template <typename T>
+  T* retrieveFromTFileAny (const std::string& path, 
+    const std::map<std::string, std::string>& /*filter*/, long ts = -1) const
+  {
+    std::string base = find_object(path, ts);
+    if (base.empty()) return nullptr;
+    TFile* f = TFile::Open((base + ".root").data(), "read");
+    if (!f) return nullptr;
+    T* obj = nullptr;
+    f->GetObject("ccdb_object", obj);
+    f->Close();
+    delete f;
+    return obj;
+  }
+
+  template <typename T>
+  int storeAsTFileAny (const T* obj, const std::string& path, 
+    const std::map<std::string, std::string>& metadata, long from, long until) const
+  {
+    std::string folder = object_folder(path);
+    gSystem->Exec(Form("mkdir -p %s", folder.data()));
+    std::string base = folder + std::to_string(from) + "_" + std::to_string(until);
+    TFile* f = TFile::Open((base + ".root").data(), "recreate");
+    if (!f) return -1;
+    f->WriteObject(obj, "ccdb_object");
+    f->Close();
+    delete f;
+    std::ofstream hdr(base + ".hdr");
+    for (auto const& item : metadata) hdr << item.first << "\t" << item.second << "\n";
+    hdr << "Valid-From\t" << from << "\n"
+        << "Valid-Until\t" << until << "\n"
+        << "ETag\t\"" << path << from << "_" << until << "\"\n";
+    return 0;
+  }
+
+  // validity intervals [from, until] of all objects of a path, ordered by Valid-From
+  std::vector<std::pair<long, long>> list_objects (const std::string& path) const
+  {
+    std::vector<std::pair<long, long>> objects;
+    DIR* dir = opendir(object_folder(path).data());
+    if (!dir) return objects;
+    while (dirent* entry = readdir(dir)) {
+      long from, until;
+      char ext[8];
+      if (std::sscanf(entry->d_name, "%ld_%ld.%7s", &from, &until, ext) == 3 && std::string(ext) == "hdr") objects.push_back({from, until});
+    }
+    closedir(dir);
+    std::sort(objects.begin(), objects.end());
+    return objects;
+  }
+
+  // headers of one listed object (the one valid in [from, until]), empty if it is gone
+  std::map<std::string, std::string> object_headers (const std::string& path, long from, long until) const
+  {
+    return read_headers(object_folder(path) + std::to_string(from) + "_" + std::to_string(until));
+  }
+
+ private:
+  std::string object_folder (const std::string& path) const
+  {
+    std::string folder = mDir + "/" + path;
+    if (folder.back() != '/') folder += "/";
+    return folder;
+  }
+
+  std::map<std::string, std::string> read_headers (const std::string& base) const
+  {
+    std::map<std::string, std::string> headers;
+    std::ifstream f(base + ".hdr");
+    std::string line;
+    while (std::getline(f, line)) {
+      size_t tab = line.find('\t');
+      if (tab != std::string::npos) headers[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+    if (headers.empty()) return headers;
+    std::ifstream obj(base + ".root", std::ios::binary | std::ios::ate); // size of the object, as in the HTTP headers
+    if (obj.is_open()) headers["Content-Length"] = std::to_string((long)obj.tellg());
+    return headers;
+  }
+
+  // base name (without extension) of the object valid at ts, empty if there is none
+  std::string find_object (const std::string& path, long ts) const
+  {
+    std::string folder = object_folder(path);
+    std::string best;
+    long best_from = -1;
+    DIR* dir = opendir(folder.data());
+    if (!dir) {
+      std::cout << "Cannot open " << folder << "\n";
+      return best;
+    }
+    while (dirent* entry = readdir(dir)) {
+      long from, until;
+      char ext[8];
+      if (std::sscanf(entry->d_name, "%ld_%ld.%7s", &from, &until, ext) != 3 || std::string(ext) != "hdr") continue;
+      if (from <= ts && ts <= until && from > best_from) {
+        best_from = from;
+        best = folder + std::to_string(from) + "_" + std::to_string(until);
+      }
+    }
+    closedir(dir);
+    return best;
+  }
+
+  std::string mDir = "ccdb";
+};
+
+#endif
@@ -0,0 +1,260 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Offline benchmarks: deterministic synthetic noise maps, stored in a local_ccdb directory,
+// microbenchmarks of the building blocks and of the full counting pipeline (no CCDB access needed)
+// Results: one json object per benchmark in <bench_dir>/bench.json
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <unistd.h>
+// root headers
+#include "TSystem.h"
+// custom headers
+#include "noisy_pixels_count.cxx"
+
+// synthetic noise maps: n_pixels noisy pixels per map, hot_pixel_fraction of them on the hot chips
+// (every 1/hot_chip_fraction-th chip), churn: fraction of the pixels replaced from one run to the next
+struct synthetic_config
+{
+  int n_pixels = 20000;
+  float hot_chip_fraction = 0.05;
+  float hot_pixel_fraction = 0.5;
+  float churn = 0.1;
+  int max_noise = 5;
+  unsigned seed = 1;
+};
+
+// the same configuration always gives the same maps
+std::vector<noise_map> generate_noise_maps (const synthetic_config& cfg, int n_runs, int first_run = 500000)
+{
+  std::mt19937 rng(cfg.seed);
+  int hot_step = std::max(1, (int)std::lround(1. / std::max(cfg.hot_chip_fraction, 1e-3f)));
+  auto random_key = [&] () {
+    int chip = rng() % N_chips;
+    if (std::uniform_real_distribution<float>(0, 1)(rng) < cfg.hot_pixel_fraction) chip -= chip % hot_step;
+    return pixel_key(chip, rng() % N_rows, rng() % N_cols);
+  };
+
+  std::vector<noise_map> maps;
+  std::map<uint32_t, int> pixs;
+  for (int i = 0; i < n_runs; i++) {
+    // remove the churned pixels, then top up with new ones
+    int n_remove = i ? std::lround(cfg.churn * pixs.size()) : 0;
+    for (int j = 0; j < n_remove && !pixs.empty(); j++) {
+      auto it = pixs.lower_bound(rng() % (N_chips << 19));
+      if (it == pixs.end()) it = pixs.begin();
+      pixs.erase(it);
+    }
+    while ((int)pixs.size() < cfg.n_pixels) pixs[random_key()] = 1 + rng() % cfg.max_noise;
+    noise_map m;
+    m.run = first_run + i;
+    for (auto const& pix : pixs) {
+      m.keys.push_back(pix.first);
+      m.noise.push_back(pix.second);
+    }
+    maps.push_back(std::move(m));
+  }
+  return maps;
+}
+
+// CCDB object with the noisy pixels of the map
+o2::itsmft::NoiseMap* make_calib (const noise_map& m)
+{
+  o2::itsmft::NoiseMap* calib = new o2::itsmft::NoiseMap(N_chips);
+  for (size_t i = 0; i < m.size(); i++) {
+    for (int n = 0; n < m.noise[i]; n++) calib->increaseNoiseCount(key_chip(m.keys[i]), key_row(m.keys[i]), key_col(m.keys[i]));
+  }
+  return calib;
+}
+
+// noise runs of the synthetic maps in the format of input.csv (half an hour apart)
+void write_synthetic_csv (std::string fname, int n_rows)
+{
+  std::ofstream f(fname);
+  f << "run,total,new,disapp,trg_start,last_sb_stop,last_go_ready\n";
+  long ts = 1714514400;
+  for (int i = 0; i < n_rows; i++, ts += 1800) {
+    f << 500000 + i << "," << 20000 + i % 1000 << "," << i % 500 << "," << i % 400 << ",\""
+      << timestamp_to_str(ts, "%d/%m/%Y, %H:%M:%S") << "\",\"" << timestamp_to_str(ts - 1500, "%d/%m/%Y, %H:%M:%S")
+      << "\",\"" << timestamp_to_str(ts - 600, "%d/%m/%Y, %H:%M:%S") << "\"\n";
+  }
+  return;
+}
+
+struct bench_result
+{
+  std::string name;
+  long n_items = 0; // per iteration
+  int iterations = 0;
+  double best = 0; // fastest iteration [s]
+  double median = 0;
+};
+
+// runs f() repeat times (after one warm-up call if warm_up)
+template <typename F>
+bench_result run_bench (std::string name, long n_items, int repeat, F f, bool warm_up = true)
+{
+  if (warm_up) f();
+  std::vector<double> t;
+  for (int i = 0; i < std::max(1, repeat); i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    t.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(t.begin(), t.end());
+  bench_result r;
+  r.name = name;
+  r.n_items = n_items;
+  r.iterations = t.size();
+  r.best = t.front();
+  r.median = t[t.size() / 2];
+  std::cout << Form("%-22s %10ld items %10.3f ms %12.1f ns/item %10.3g items/s\n", name.data(), n_items,
+    1e3 * r.median, 1e9 * r.median / std::max(1L, n_items), n_items / r.median);
+  return r;
+}
+
+// sum of the results, so that the compiler cannot drop a benchmarked call
+long bench_sink = 0;
+
+// bench_dir: working directory of the benchmark (synthetic CCDB, caches, outputs), created if needed
+// pipeline: also run compare_noise_maps on the synthetic CCDB (cold: download and extract, warm: cached maps)
+void noisy_pixels_bench (int n_pixels = 20000, int n_runs = 20, float churn = 0.1, int repeat = 5,
+  std::string bench_dir = "bench", bool pipeline = true, bool dense = false, int n_workers = 4)
+{
+  synthetic_config cfg;
+  cfg.n_pixels = n_pixels;
+  cfg.churn = churn;
+  std::vector<noise_map> maps = generate_noise_maps(cfg, std::max(2, n_runs));
+  std::vector<o2::itsmft::NoiseMap*> calibs;
+  for (auto const& m : maps) calibs.push_back(make_calib(m));
+
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd))) return;
+  gSystem->Exec(Form("rm -rf %s && mkdir -p %s/noise_maps", bench_dir.data(), bench_dir.data()));
+  if (chdir(bench_dir.data()) != 0) {
+    std::cout << "Cannot open " << bench_dir << "\n";
+    return;
+  }
+  std::vector<bench_result> results;
+
+  // extraction of the noisy pixels from the CCDB object
+  results.push_back(run_bench("extract_sparse", n_pixels, repeat, [&] () {
+    noise_map m;
+    extract_noisy_pixels_sparse(calibs[0], m);
+    bench_sink += m.size();
+  }));
+  if (dense) {
+    results.push_back(run_bench("extract_dense", (long)N_chips * N_rows * N_cols, 1, [&] () {
+      noise_map m;
+      extract_noisy_pixels_dense(calibs[0], m);
+      bench_sink += m.size();
+    }, false));
+    results.push_back(run_bench("extract_dense_mt", (long)N_chips * N_rows * N_cols, 1, [&] () {
+      noise_map m;
+      extract_noisy_pixels_dense(calibs[0], m, n_workers);
+      bench_sink += m.size();
+    }, false));
+  }
+
+  // comparison of consecutive maps
+  results.push_back(run_bench("diff", (long)n_pixels * (maps.size() - 1), repeat, [&] () {
+    for (size_t i = 1; i < maps.size(); i++) bench_sink += diff_noise_maps(maps[i], maps[i-1]).new_pixs;
+  }));
+  results.push_back(run_bench("clusters", (long)n_pixels * maps.size(), repeat, [&] () {
+    for (auto const& m : maps) bench_sink += find_clusters(m, n_workers).n_clusters;
+  }));
+
+  // cache files
+  results.push_back(run_bench("cache_write", (long)n_pixels * maps.size(), repeat, [&] () {
+    for (auto const& m : maps) write_noise_map(m, noise_map_fname(m.run));
+  }));
+  results.push_back(run_bench("cache_read", (long)n_pixels * maps.size(), repeat, [&] () {
+    noise_map m;
+    for (auto const& mi : maps) if (read_noise_map(noise_map_fname(mi.run), m)) bench_sink += m.size();
+  }));
+  results.push_back(run_bench("cache_mmap", (long)n_pixels * maps.size(), repeat, [&] () {
+    for (auto const& mi : maps) {
+      noise_map_view v(noise_map_fname(mi.run));
+      if (v.is_open()) bench_sink += v.keys()[v.size() - 1];
+    }
+  }));
+  results.push_back(run_bench("mask_merge", (long)n_pixels * maps.size(), repeat, [&] () {
+    std::vector<const uint32_t*> keys;
+    std::vector<const int32_t*> noise;
+    std::vector<size_t> sizes;
+    for (auto const& m : maps) {
+      keys.push_back(m.keys.data());
+      noise.push_back(m.noise.data());
+      sizes.push_back(m.size());
+    }
+    merge_noise_maps(keys, noise, sizes, [&] (uint32_t, int n_runs, long) { bench_sink += n_runs; });
+  }));
+
+  // csv input of the plots
+  const int n_rows = 100000;
+  write_synthetic_csv("bench_input.csv", n_rows);
+  results.push_back(run_bench("read_csv", n_rows, repeat, [&] () {
+    std::vector<noise>* runs = read_csv("bench_input.csv");
+    if (runs) bench_sink += runs->size();
+    delete runs;
+  }));
+  results.push_back(run_bench("read_noise_run_table", n_rows, repeat, [&] () {
+    noise_run_table runs;
+    read_noise_run_table("bench_input.csv", runs);
+    bench_sink += runs.size();
+  }));
+  std::vector<std::string> dates;
+  for (int i = 0; i < n_rows; i++) dates.push_back(timestamp_to_str(1714514400L + 1807L * i, "%d/%m/%Y, %H:%M:%S"));
+  results.push_back(run_bench("datestring_to_long", n_rows, repeat, [&] () {
+    for (auto const& d : dates) bench_sink += datestring_to_long(d, "%d/%m/%Y, %H:%M:%S");
+  }));
+
+  // full pipeline on the synthetic CCDB: map i valid in [1000 i, 1000 i + 999]
+  if (pipeline) {
+    local_ccdb ccdb;
+    ccdb.init("ccdb");
+    for (size_t i = 0; i < maps.size(); i++) {
+      std::map<std::string, std::string> metadata = {{"runNumber", std::to_string(maps[i].run)}};
+      ccdb.storeAsTFileAny(calibs[i], mft_geometry::ccdb_path, metadata, 1000 * i, 1000 * i + 999);
+    }
+    long ts_last = 1000 * (maps.size() - 1);
+    gSystem->Exec("rm -rf noise_maps && mkdir -p noise_maps");
+    results.push_back(run_bench("pipeline_cold", maps.size() - 1, 1, [&] () {
+      compare_noise_maps<local_ccdb>(1000, ts_last, false, "ccdb", n_workers);
+    }, false));
+    results.push_back(run_bench("pipeline_warm", maps.size() - 1, 1, [&] () {
+      compare_noise_maps<local_ccdb>(1000, ts_last, false, "ccdb", n_workers);
+    }, false));
+    if (dense) {
+      // validation run: every map extracted again and cross-checked with the dense scan
+      results.push_back(run_bench("pipeline_validate", maps.size() - 1, 1, [&] () {
+        compare_noise_maps<local_ccdb>(1000, ts_last, false, "ccdb", n_workers, 16, n_workers);
+      }, false));
+    }
+  }
+  for (auto calib : calibs) delete calib;
+
+  // machine-readable results
+  std::ofstream f("bench.json");
+  f << "{\"config\": {\"n_pixels\": " << n_pixels << ", \"n_runs\": " << maps.size() << ", \"churn\": " << churn
+    << ", \"repeat\": " << repeat << ", \"n_workers\": " << n_workers << "},\n \"results\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const bench_result& r = results[i];
+    f << (i ? ",\n  " : "\n  ") << "{\"name\": \"" << r.name << "\", \"n_items\": " << r.n_items
+      << ", \"iterations\": " << r.iterations << ", \"best_s\": " << r.best << ", \"median_s\": " << r.median
+      << ", \"items_per_s\": " << r.n_items / r.median << "}";
+  }
+  f << "\n ]}\n";
+  f.close();
+  std::cout << "Results written to " << bench_dir << "/bench.json (checksum " << bench_sink << ")\n";
+  if (chdir(cwd) != 0) std::cout << "Cannot return to " << cwd << "\n";
+  return;
+}
@@ -0,0 +1,213 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Noisy pixels per chip: the total, new and disappeared pixels of every chip in every cached noise map, kept as a dense
+// runs x chips matrix (noise_maps/chip_counts.ncm, built in one pass over the maps, later only the new runs are added)
+// and summed per half-disk, disk and half; trend plots per disk, per half and for single chips
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <chrono>
+// root headers
+#include "TROOT.h"
+#include "TSystem.h"
+#include "TStyle.h"
+#include "TH2.h"
+#include "TGraph.h"
+#include "TCanvas.h"
+#include "TLegend.h"
+#include "TLine.h"
+// custom headers
+#include "noisy_pixels_plots.cxx"
+
+// adds the cached maps missing from the matrix and writes the changed rows to the file; every map is mapped once
+// and compared with the previous one (the first run of the matrix has no new or disappeared pixels; a new run
+// after a last run whose map is no longer cached is skipped)
+// runs cached after the matrix was written but older than its last run (backfilled) are merged by run number:
+// the rows from the first of them on are recomputed, which needs the maps of the later runs to be still cached
+bool update_chip_matrix (chip_matrix& m, std::string fname, std::string folder = "noise_maps/")
+{
+  if (!m.read(fname)) return false;
+  std::vector<int> cached = list_cached_runs(folder);
+  const std::vector<int>& runs = m.runs();
+  size_t first = runs.size();
+  for (int run : cached) {
+    if (!runs.empty() && run >= runs.back()) break;
+    if (std::binary_search(runs.begin(), runs.end(), run)) continue;
+    first = std::upper_bound(runs.begin(), runs.end(), run) - runs.begin();
+    break;
+  }
+  if (first < runs.size()) {
+    for (size_t i = first; i < runs.size(); i++) {
+      if (std::binary_search(cached.begin(), cached.end(), runs[i])) continue;
+      std::cout << "Chip matrix: backfilled runs before " << runs[first] << " not merged, the map of run "
+                << runs[i] << " is no longer cached\n";
+      first = runs.size();
+      break;
+    }
+  }
+  size_t n_old = runs.size();
+  int last = first ? runs[first - 1] : -1;
+  m.truncate(first);
+
+  std::unique_ptr<noise_map_view> prev;
+  for (int run : cached) {
+    if (run < last) continue;
+    std::unique_ptr<noise_map_view> curr(new noise_map_view(noise_map_fname(run, folder)));
+    if (!curr->is_open()) return false;
+    if (run != last && !prev && first > 0) {
+      // the run before has no map to be compared with: no row rather than one without new and disappeared pixels
+      std::cout << "Chip matrix: run " << run << " skipped, the map of run " << last << " is no longer cached\n";
+    } else if (run != last) {
+      const noise_map_view& p = prev ? *prev : *curr;
+      m.add_run(run, diff_noise_maps(curr->keys(), curr->size(), p.keys(), p.size()));
+    }
+    prev = std::move(curr);
+  }
+  std::cout << "Chip matrix: " << m.n_runs() - n_old << " runs added";
+  if (first < n_old) std::cout << " (merged from row " << first << " on)";
+  std::cout << ", " << m.n_runs() << " in total\n";
+  return m.append(fname, first);
+}
+
+// one pad per quantity (total, new, disappeared), one graph per group of chips vs. run number
+// sums[q]: n_runs x n_groups
+void draw_group_trends (const std::vector<int>& runs, const std::vector<std::vector<int>>& sums, int n_groups,
+  const std::vector<std::string>& labels, std::string fname)
+{
+  const Color_t colors[10] = {kBlack, kRed+1, kBlue, kGreen+2, kMagenta+1, kOrange+7, kCyan+2, kViolet+1, kGray+2, kYellow+3};
+  std::vector<double> x(runs.begin(), runs.end());
+  TCanvas* c = new TCanvas("", "", 900, 1200);
+  c->Divide(1, N_chip_quantities);
+  for (int q = 0; q < N_chip_quantities; q++) {
+    c->cd(q + 1);
+    int y_max = *std::max_element(sums[q].begin(), sums[q].end());
+    TLegend* l = new TLegend(0.12, 0.78, 0.88, 0.92);
+    l->SetNColumns(std::min(n_groups, 5));
+    for (int g = 0; g < n_groups; g++) {
+      std::vector<double> y(runs.size());
+      for (size_t i = 0; i < runs.size(); i++) y[i] = sums[q][i * n_groups + g];
+      TGraph* gr = new TGraph(x.size(), x.data(), y.data());
+      format_graph(gr, colors[g % 10], 1, kFullCircle);
+      gr->SetMarkerSize(0.5);
+      if (g == 0) {
+        gr->SetTitle(Form(";Run number;#%s noisy pixels", chip_quantity_names[q]));
+        gr->GetHistogram()->SetMinimum(0);
+        gr->GetHistogram()->SetMaximum(1.35 * std::max(1, y_max));
+        gr->Draw("ALP");
+      } else {
+        gr->Draw("LP SAME");
+      }
+      l->AddEntry(gr, labels[g].data(), "LP");
+    }
+    l->SetBorderSize(0);
+    l->SetFillStyle(0);
+    l->SetTextSize(0.04);
+    l->Draw();
+  }
+  c->Print(fname.data());
+  return;
+}
+
+// counts of one quantity for all runs (x) and chips (y), with the boundaries of the half-disks
+void draw_chip_map (const chip_matrix& m, int q, std::string fname)
+{
+  int n_runs = m.n_runs();
+  TH2D* h = new TH2D(Form("h_chips_%s", chip_quantity_names[q]), Form(";Run index;Chip ID;#%s noisy pixels", chip_quantity_names[q]),
+    n_runs, 0, n_runs, m.n_chips(), 0, m.n_chips());
+  h->SetDirectory(nullptr);
+  for (int i = 0; i < n_runs; i++) {
+    const int32_t* counts = m.row(i, q);
+    for (int chip = 0; chip < m.n_chips(); chip++) if (counts[chip]) h->SetBinContent(i + 1, chip + 1, counts[chip]);
+  }
+  TCanvas* c = new TCanvas("", "", 900, 700);
+  set_margins(c, 0.05, 0.15, 0.10, 0.10);
+  c->SetLogz();
+  h->GetZaxis()->SetLabelSize(0.03);
+  h->Draw("colz");
+  for (int j = 1; j < N_half_disks; j++) {
+    TLine* l = new TLine(0, half_disk_first_chip(j), n_runs, half_disk_first_chip(j));
+    l->SetLineStyle(j == N_disks ? 1 : 2);
+    l->Draw();
+  }
+  c->Print(fname.data());
+  return;
+}
+
+std::string chip_label (int chip)
+{
+  int half_disk = chip_half_disk(chip);
+  return Form("chip %i (half %i, disk %i)", chip, half_disk / N_disks, half_disk % N_disks);
+}
+
+// chips: chipIDs (comma-separated) whose trends are drawn, by default the 5 chips with the most new and disappeared pixels
+// the plots go to <out_dir>/chips/
+void noisy_pixels_chips (std::string chips = "", std::string out_dir = ".")
+{
+  gROOT->SetBatch(true);
+  gStyle->SetOptStat(0);
+  auto t_start = std::chrono::steady_clock::now();
+  chip_matrix m;
+  if (!update_chip_matrix(m, std::string(mft_geometry::folder) + "chip_counts.ncm")) return;
+  if (!m.n_runs()) {
+    std::cout << "No cached noise maps found\n";
+    return;
+  }
+  std::vector<std::vector<int>> half_disk_sums, disk_sums, half_sums;
+  for (int q = 0; q < N_chip_quantities; q++) {
+    layout_counts sums = aggregate_layout(m, q);
+    half_disk_sums.push_back(sums.half_disk);
+    disk_sums.push_back(sums.disk);
+    half_sums.push_back(sums.half);
+  }
+  std::cout << "Matrix updated and aggregated in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count() << " s\n";
+
+  std::string folder = out_dir + "/chips/";
+  gSystem->Exec(Form("mkdir -p %s", folder.data()));
+  std::vector<std::string> labels;
+  for (int j = 0; j < N_half_disks; j++) labels.push_back(Form("half %i, disk %i", j / N_disks, j % N_disks));
+  draw_group_trends(m.runs(), half_disk_sums, N_half_disks, labels, folder + "trend_half_disks.pdf");
+  labels.clear();
+  for (int d = 0; d < N_disks; d++) labels.push_back(Form("disk %i", d));
+  draw_group_trends(m.runs(), disk_sums, N_disks, labels, folder + "trend_disks.pdf");
+  draw_group_trends(m.runs(), half_sums, N_halves, {"half 0", "half 1"}, folder + "trend_halves.pdf");
+  draw_chip_map(m, chip_new, folder + "chips_new.pdf");
+  draw_chip_map(m, chip_disapp, folder + "chips_disapp.pdf");
+
+  // chips driving the changes: new + disappeared pixels over all runs
+  std::vector<long> changes(m.n_chips(), 0);
+  for (size_t i = 0; i < m.n_runs(); i++) {
+    const int32_t* n_new = m.row(i, chip_new);
+    const int32_t* n_disapp = m.row(i, chip_disapp);
+    for (int chip = 0; chip < m.n_chips(); chip++) changes[chip] += n_new[chip] + n_disapp[chip];
+  }
+  std::vector<int> ranking(m.n_chips());
+  std::iota(ranking.begin(), ranking.end(), 0);
+  std::stable_sort(ranking.begin(), ranking.end(), [&] (int a, int b) { return changes[a] > changes[b]; });
+  std::cout << "Chips with the most new and disappeared pixels:\n";
+  for (int k = 0; k < 10; k++) std::cout << " " << chip_label(ranking[k]) << ": " << changes[ranking[k]] << "\n";
+
+  std::vector<int> selected;
+  std::stringstream ss(chips);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    long chip = parse_positive_int(item);
+    if (chip >= 0 && chip < m.n_chips()) selected.push_back(chip);
+    else std::cout << "Invalid chipID " << item << "\n";
+  }
+  if (chips.empty()) selected.assign(ranking.begin(), ranking.begin() + 5);
+  for (int chip : selected) {
+    std::vector<std::vector<int>> history;
+    for (int q = 0; q < N_chip_quantities; q++) history.push_back(m.chip_history(chip, q));
+    draw_group_trends(m.runs(), history, 1, {chip_label(chip)}, folder + Form("trend_chip_%i.pdf", chip));
+  }
+  return;
+}
@@ -9,137 +9,598 @@
 #include <tuple>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// posix headers
+#include <unistd.h>
 // root headers
+#include "TROOT.h"
 #include "TSystem.h"
 #include "TFile.h"
 // o2 headers
 #include "CCDB/CcdbApi.h"
 #include "DataFormatsITSMFT/NoiseMap.h"
+// custom headers
+#include "utilities.h"
+#include "local_ccdb.h"
 
 o2::ccdb::CcdbApi api;
+pipeline_stats timing; // stage timers and counters of the last job
 
-std::tuple<int, long, long> read_noise_maps (long ts, bool rewrite, bool verbose = false)
+// indices of the non-zero values in buf[0, n), returns their number (out has room for n indices)
+// with SSE2, 16 values per step are compared with zero and reduced to a bit mask; scalar otherwise and for the tail
+inline int find_nonzero (const int32_t* buf, int n, int* out)
 {
-  gSystem->Exec("mkdir -p noise_maps/");
+  int n_out = 0, i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    int mask = 0;
+    for (int j = 0; j < 4; j++) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(buf + i + 4 * j));
+      mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << (4 * j);
+    }
+    for (mask = ~mask & 0xffff; mask; mask &= mask - 1) out[n_out++] = i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < n; i++) if (buf[i]) out[n_out++] = i;
+  return n_out;
+}
 
-  std::map<std::string, std::string> filter;
-  auto calib = api.retrieveFromTFileAny<o2::itsmft::NoiseMap>("MFT/Calib/NoiseMap/", filter, ts);
+// dense scan: ask the noise map for the noise level of every pixel
+// (slow, ~490M calls per MFT map and 26 times more for ITS; kept to validate the sparse extraction)
+// n_threads workers take chunks of chips, read the noise levels of a row into a buffer and keep its non-zero
+// pixels (find_nonzero); the chunks are concatenated in chip order, so the keys come out sorted
+template <typename G>
+void extract_noisy_pixels_dense (o2::itsmft::NoiseMap* calib, basic_noise_map<G>& noisy_pixs, int n_threads = 1)
+{
+  const int chunk_size = 8; // chips
+  int n_chunks = (G::n_chips + chunk_size - 1) / chunk_size;
+  std::vector<basic_noise_map<G>> chunks(n_chunks);
+  std::atomic<int> next_chunk(0), chips_done(0);
+  std::mutex print_mutex;
+  auto worker = [&] () {
+    std::vector<int32_t> levels(G::n_cols);
+    std::vector<int> cols(G::n_cols);
+    for (int c = next_chunk++; c < n_chunks; c = next_chunk++) {
+      int chip_first = c * chunk_size;
+      int chip_last = std::min(G::n_chips, chip_first + chunk_size);
+      for (int chipID = chip_first; chipID < chip_last; chipID++) {
+        for (int row = 0; row < G::n_rows; row++) {
+          for (int col = 0; col < G::n_cols; col++) levels[col] = calib->getNoiseLevel(chipID, row, col);
+          int n = find_nonzero(levels.data(), G::n_cols, cols.data());
+          for (int k = 0; k < n; k++) chunks[c].add(chipID, row, cols[k], levels[cols[k]]);
+        }
+      }
+      int done = chips_done += chip_last - chip_first;
+      if (done / 100 != (done - chip_last + chip_first) / 100) {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << " " << done << " chips read\n";
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < n_threads; i++) threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads) t.join();
+
+  size_t n_pixels = noisy_pixs.size();
+  for (auto const& chunk : chunks) n_pixels += chunk.size();
+  noisy_pixs.keys.reserve(n_pixels);
+  noisy_pixs.noise.reserve(n_pixels);
+  for (auto const& chunk : chunks) {
+    noisy_pixs.keys.insert(noisy_pixs.keys.end(), chunk.keys.begin(), chunk.keys.end());
+    noisy_pixs.noise.insert(noisy_pixs.noise.end(), chunk.noise.begin(), chunk.noise.end());
+  }
+  return;
+}
+
+// sparse extraction: walk only the populated entries of the noise map
+// (per-chip std::map keyed by (row << 10) + col, i.e. already ordered by row and col)
+template <typename G>
+void extract_noisy_pixels_sparse (o2::itsmft::NoiseMap* calib, basic_noise_map<G>& noisy_pixs)
+{
+  int n_chips = std::min((int)calib->size(), G::n_chips);
+  for (int chipID = 0; chipID < n_chips; chipID++) {
+    std::map<int, int>* chip_map = calib->getChipMap(chipID);
+    if (!chip_map || chip_map->empty()) continue;
+    for (auto const& entry : *chip_map) {
+      int row = calib->key2Row(entry.first);
+      int col = calib->key2Col(entry.first);
+      // same selection as the dense scan: pixels inside the chip with a non-zero noise level
+      // (the entry holds the count getNoiseLevel would look up again)
+      if (row < 0 || row >= G::n_rows || col >= G::n_cols) continue;
+      if (entry.second) noisy_pixs.add(chipID, row, col, entry.second);
+    }
+  }
+  return;
+}
+
+// load a cached noise map; caches from the ROOT format (<folder><run>.root,
+// std::vector<std::vector<int>> of chipID, row, col, noise) are converted on the fly
+// the reading is timed as stage (decode, or reload of an evicted map), a conversion as sort and write
+template <typename G>
+bool load_noise_map (int run, basic_noise_map<G>& m, int stage = stage_decode)
+{
+  std::string fname = noise_map_fname(run, G::folder);
+  if (!gSystem->AccessPathName(fname.data())) {
+    scoped_timer t(timing, stage, run);
+    bool ok = read_noise_map(fname, m);
+    if (ok) timing.add_bytes(run, noise_map_bytes(m), 0);
+    return ok;
+  }
+
+  std::string fname_root = Form("%s%i.root", G::folder, run);
+  if (gSystem->AccessPathName(fname_root.data())) return false;
+  std::vector<std::vector<int>>* pixs = nullptr;
+  {
+    scoped_timer t(timing, stage, run);
+    TFile* f = TFile::Open(fname_root.data(), "read");
+    if (!f) return false;
+    f->GetObject("noisy_pixs", pixs);
+    f->Close();
+    delete f;
+  }
+  if (!pixs) return false;
+  {
+    scoped_timer t(timing, stage_sort, run);
+    std::sort(pixs->begin(), pixs->end());
+    m.run = run;
+    m.keys.clear();
+    m.noise.clear();
+    for (auto const& pix : *pixs) m.add(pix[0], pix[1], pix[2], pix[3]);
+    delete pixs;
+  }
+  std::cout << "Converting " << fname_root << " to " << fname << "\n";
+  scoped_timer t(timing, stage_write, run);
+  if (write_noise_map(m, fname)) timing.add_bytes(run, 0, noise_map_bytes(m));
+  return true;
+}
+
+// validity interval of one noise map in the CCDB
+struct noise_map_info
+{
+  int run = -1;
+  long val_from = -1;
+  long val_until = -1;
+  long ts = -1; // timestamp at which the object was looked up
+  std::string etag;
+  long size = 0; // of the object in the CCDB, if known
+};
+
+// run and validity interval from the headers of the noise map valid at ts
+template <typename G>
+noise_map_info noise_map_info_from_headers (std::map<std::string, std::string>& headers, long ts)
+{
+  if (headers.find("runNumber") == headers.end()) {
+    throw std::runtime_error(Form("No %s noise map found for timestamp %ld", G::name, ts));
+  }
+
+  noise_map_info info;
+  info.run = std::stoi(headers["runNumber"]);
+  info.val_from = std::stol(headers["Valid-From"]);
+  info.val_until = std::stol(headers["Valid-Until"]);
+  info.ts = ts;
+  info.etag = headers["ETag"];
+  if (headers.count("Content-Length")) info.size = std::stol(headers["Content-Length"]);
+  return info;
+}
 
-  std::map<std::string, std::string> headers = api.retrieveHeaders("MFT/Calib/NoiseMap/", filter, ts);
+template <typename G, typename Api>
+noise_map_info retrieve_noise_map_info (Api& ccdb, long ts, bool verbose = false)
+{
+  scoped_timer t(timing, stage_lookup);
+  timing.count("header_lookups");
+  std::map<std::string, std::string> filter;
+  std::map<std::string, std::string> headers = ccdb.retrieveHeaders(G::ccdb_path, filter, ts);
   if (verbose)
   {
     std::map<std::string, std::string>::iterator it;
     for (it = headers.begin(); it != headers.end(); it++) std::cout << it->first << "\t" << it->second << "\n";
   }
+  // a failed lookup is only counted, its time has no run to go to
+  if (headers.find("runNumber") == headers.end()) timing.count("failed_header_lookups");
+  noise_map_info info = noise_map_info_from_headers<G>(headers, ts);
+  t.run = info.run;
+  return info;
+}
+
+template <typename G>
+bool is_noise_map_cached (int run)
+{
+  return !gSystem->AccessPathName(noise_map_fname(run, G::folder).data()) // or a cache in the ROOT format, see load_noise_map
+    || !gSystem->AccessPathName(Form("%s%i.root", G::folder, run));
+}
 
-  int run_no = std::stoi(headers["runNumber"]);
-  long val_from = std::stol(headers["Valid-From"]);
-  long val_until = std::stol(headers["Valid-Until"]);
+template <typename G> std::string index_fname () { return std::string(G::folder) + "index.csv"; }
+template <typename G> std::string history_fname () { return std::string(G::folder) + "history.nmh"; }
 
-  std::string fname = Form("noise_maps/%i.root", run_no);
-  bool exists = !gSystem->AccessPathName(fname.data());
-  if(exists && !rewrite) 
+// timestamps inside a final indexed interval whose map is cached resolve without any CCDB call;
+// unknown intervals and the newest one (whose Valid-Until may have been cut short since) are looked up
+// and (re)written in the index
+template <typename G, typename Api>
+noise_map_info lookup_noise_map_info (Api& ccdb, validity_index& index, long ts, bool rewrite = false, bool verbose = false)
+{
+  const validity_entry* e = rewrite ? nullptr : index.find(ts);
+  if (e && index.is_final(*e) && is_noise_map_cached<G>(e->run))
   {
-    std::cout << "Noise map for " << run_no << " already read\n";
-  } 
-  else 
+    timing.count("index_hits");
+    noise_map_info info;
+    info.run = e->run;
+    info.val_from = e->val_from;
+    info.val_until = e->val_until;
+    info.ts = ts;
+    info.etag = e->etag;
+    return info;
+  }
+  noise_map_info info = retrieve_noise_map_info<G>(ccdb, ts, verbose);
+  index.add({info.val_from, info.val_until, info.run, info.etag});
+  return info;
+}
+
+// decode the cached noise map, or download it, extract the noisy pixels and write the cache
+// dense_scan > 0: validate the extraction with the dense scan on dense_scan threads
+template <typename Api, typename G>
+bool fetch_noise_map (Api& ccdb, const noise_map_info& info, basic_noise_map<G>& noisy_pixs, bool rewrite, int dense_scan = 0)
+{
+  if (!rewrite && load_noise_map(info.run, noisy_pixs)) {
+    timing.count("maps_from_disk");
+    return true;
+  }
+
+  o2::itsmft::NoiseMap* calib = nullptr;
   {
-    std::cout << "Reading noise map for " << run_no << "\n";
-    std::vector<std::vector<int>> noisy_pixs; // chipID, row, col, noise
-    int noisy_pix_count = 0;
-
-    const int N_pix = 936; // 936
-    for (int chipID = 0; chipID < N_pix; chipID++) {
-      if ((chipID + 1) % 50 == 0) std::cout << " " << chipID+1 << " chips read\n";
-      for (int row = 0; row < 512; row++) {
-        for (int col = 0; col < 1024; col++) {
-          int noise = calib->getNoiseLevel(chipID, row, col);
-          if (!noise) {
-            noise = -1;
-          } else {
-            noisy_pixs.push_back({chipID, row, col, noise});
-            noisy_pix_count++;
-          }
-        }
+    scoped_timer t(timing, stage_retrieve, info.run);
+    std::map<std::string, std::string> filter;
+    calib = ccdb.template retrieveFromTFileAny<o2::itsmft::NoiseMap>(G::ccdb_path, filter, info.ts);
+  }
+  if (!calib) return false;
+  timing.count("maps_downloaded");
+  timing.add_bytes(info.run, info.size, 0);
+
+  noisy_pixs.run = info.run;
+  noisy_pixs.keys.clear();
+  noisy_pixs.noise.clear();
+  {
+    scoped_timer t(timing, stage_scan, info.run);
+    extract_noisy_pixels_sparse(calib, noisy_pixs);
+    if (dense_scan > 0)
+    {
+      // validation: the dense scan has to give exactly the same list
+      basic_noise_map<G> noisy_pixs_dense;
+      noisy_pixs_dense.run = info.run;
+      extract_noisy_pixels_dense(calib, noisy_pixs_dense, dense_scan);
+      if (noisy_pixs_dense != noisy_pixs) {
+        delete calib;
+        throw std::runtime_error(Form("Sparse and dense scans of the noise map for %i differ (%lu vs %lu pixels)", 
+          info.run, noisy_pixs.size(), noisy_pixs_dense.size()));
       }
+      std::cout << " Dense scan agrees with the sparse extraction\n";
     }
+  }
+  delete calib;
 
-    std::sort(noisy_pixs.begin(), noisy_pixs.end(), 
-      [](auto const& lhs, auto const& rhs) { return lhs[0] < rhs[0]; }
-    );
+  // both scans fill the pixels ordered by chipID, row and col, i.e. with sorted keys
+  std::cout << Form("Noise map for %i read: %lu noisy pixels found\n", info.run, noisy_pixs.size());
+  scoped_timer t(timing, stage_write, info.run);
+  if (!write_noise_map(noisy_pixs, noise_map_fname(info.run, G::folder))) return false;
+  timing.add_bytes(info.run, 0, noise_map_bytes(noisy_pixs));
+  return true;
+}
 
-    std::cout << " Done: " << noisy_pix_count << " noisy pixels found\n";
+template <typename G = mft_geometry>
+std::tuple<int, long, long> read_noise_maps (long ts, bool rewrite, bool verbose = false, int dense_scan = 0)
+{
+  gSystem->Exec(Form("mkdir -p %s", G::folder));
 
-    TFile* fout = TFile::Open(fname.data(), "recreate");
-    fout->WriteObject(&noisy_pixs, "noisy_pixs");
-    fout->Close();
-  }
-  return {run_no, val_from, val_until};
+  validity_index index;
+  index.load(index_fname<G>());
+  noise_map_info info = lookup_noise_map_info<G>(api, index, ts, rewrite, verbose);
+  basic_noise_map<G> noisy_pixs;
+  if (fetch_noise_map(api, info, noisy_pixs, rewrite, dense_scan)) index.save(index_fname<G>());
+  return {info.run, info.val_from, info.val_until};
 }
 
-void compare_noise_maps (long ts_first, long ts_last)
+// noise maps needed for a time range and the (previous, current) pairs to compare
+struct validity_chain
+{
+  std::vector<noise_map_info> maps; // in the order of validity
+  std::vector<std::pair<int, int>> steps; // indices of the previous and current map
+};
+
+// walk the validity chain using the headers only (no object is downloaded)
+template <typename G, typename Api>
+validity_chain resolve_validity_chain (Api& ccdb, validity_index& index, long ts_first, long ts_last)
 {
+  validity_chain chain;
+  size_t n_indexed = index.size();
   long ts_curr = ts_first;
+  while (ts_curr < ts_last)
+  {
+    noise_map_info info_curr = lookup_noise_map_info<G>(ccdb, index, ts_curr);
+    // consecutive steps share the map: the previous map is usually the last current one,
+    // whose headers are already known
+    long ts_prev = info_curr.val_from-1;
+    bool prev_known = !chain.maps.empty() && chain.maps.back().val_from <= ts_prev && ts_prev <= chain.maps.back().val_until;
+    if (!prev_known) chain.maps.push_back(lookup_noise_map_info<G>(ccdb, index, ts_prev));
+    chain.maps.push_back(info_curr);
+    chain.steps.push_back({(int)chain.maps.size() - 2, (int)chain.maps.size() - 1});
+    ts_curr = info_curr.val_until+1;
+  }
+  std::cout << "Validity chain resolved: " << chain.steps.size() << " noise runs, " 
+            << chain.maps.size() << " noise maps, " << index.size() - n_indexed << " new intervals\n";
+  return chain;
+}
 
-  std::vector<std::vector<int>> noise_run_stats;
+template <typename G> std::string stats_fname () { return std::string("input_noisy_pixs") + G::suffix + ".csv"; }
+template <typename G> std::string chip_stats_fname () { return std::string("input_noisy_pixs_chips") + G::suffix + ".csv"; }
+// clusters: number of clusters of noisy pixels, max_cluster: size of the largest one,
+// cl_*: clusters with 1, 2, 3-4, 5-8, 9-16 and more pixels, new_*: clusters of the new pixels only
+const std::string stats_header = "run,total,new,disapp,valid_from,valid_until,"
+  "clusters,max_cluster,cl_1,cl_2,cl_3_4,cl_5_8,cl_9_16,cl_17,new_clusters,new_isolated";
+// per-chip breakdown (only chips with at least one noisy, new or disappeared pixel)
+const std::string chip_stats_header = "run,chip,total,new,disapp";
+// per-run stage timing of the last job (.csv and .json)
+template <typename G> std::string timing_fname () { return std::string("timing_noisy_pixs") + G::suffix; }
 
-  while (ts_curr < ts_last)
+// latest Valid-From of the noise runs in a stats csv, -1 if there is none
+// (csvs written before the validity columns were added are resolved through the index)
+// the Valid-Until in the csv is not used: for the newest map it was open-ended when the row was written
+long last_processed_valid_from (std::string fname, const validity_index& index)
+{
+  std::ifstream f(fname);
+  std::string line;
+  if (!f.is_open() || !std::getline(f, line)) return -1;
+  bool has_validity = line.find("valid_from") != std::string::npos;
+  long last = -1;
+  while (std::getline(f, line)) {
+    int run;
+    long val_from;
+    if (has_validity) {
+      if (std::sscanf(line.data(), "%d,%*d,%*d,%*d,%ld", &run, &val_from) == 2) last = std::max(last, val_from);
+    } else if (std::sscanf(line.data(), "%d", &run) == 1) {
+      const validity_entry* e = index.find_run(run);
+      if (!e) {
+        std::cout << "Validity of run " << run << " from " << fname << " unknown\n";
+        return -1;
+      }
+      last = std::max(last, e->val_from);
+    }
+  }
+  return last;
+}
+
+// write header + (existing rows if append) + new rows to a temporary file and move it over fname,
+// so the csv is never left half-written; existing rows with fewer columns are padded
+bool write_csv_atomic (std::string fname, std::string header, const std::vector<std::string>& rows, bool append)
+{
+  std::string fname_tmp = fname + ".tmp";
+  std::ofstream out(fname_tmp);
+  if (!out.is_open()) {
+    std::cout << "Cannot open " << fname_tmp << "\n";
+    return false;
+  }
+  out << header << "\n";
+  int n_columns = std::count(header.begin(), header.end(), ',') + 1;
+  std::ifstream in(fname);
+  std::string line;
+  if (append && in.is_open() && std::getline(in, line)) {
+    while (std::getline(in, line)) {
+      if (line.empty()) continue;
+      int n = std::count(line.begin(), line.end(), ',') + 1;
+      out << line << std::string(std::max(0, n_columns - n), ',') << "\n";
+    }
+  }
+  for (auto const& row : rows) out << row << "\n";
+  out.close();
+  if (out.fail() || std::rename(fname_tmp.data(), fname.data()) != 0) {
+    std::cout << "Cannot write " << fname << "\n";
+    return false;
+  }
+  return true;
+}
+
+// append rows to the csv and flush them to disk (one run at a time, e.g. in watch mode), the header is written
+// to a new csv; a csv with another header (older columns) is rewritten once with write_csv_atomic
+bool append_csv_rows (std::string fname, std::string header, const std::vector<std::string>& rows)
+{
+  std::ifstream in(fname);
+  std::string line;
+  bool has_header = in.is_open() && std::getline(in, line) && !line.empty();
+  in.close();
+  if (has_header && line != header) return write_csv_atomic(fname, header, rows, true);
+
+  FILE* f = std::fopen(fname.data(), "a");
+  if (!f) {
+    std::cout << "Cannot open " << fname << "\n";
+    return false;
+  }
+  bool ok = has_header || std::fprintf(f, "%s\n", header.data()) >= 0;
+  for (auto const& row : rows) ok = ok && std::fprintf(f, "%s\n", row.data()) >= 0;
+  ok = ok && std::fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if (std::fclose(f) != 0 || !ok) {
+    std::cout << "Cannot write " << fname << "\n";
+    return false;
+  }
+  return true;
+}
+
+// statistics of one noise run, the current map compared to the previous one:
+// a row of the stats csv (run_rows) and the rows of the per-chip breakdown (chip_rows)
+template <typename M>
+void noise_step_stats (const M& curr, const M& prev, const noise_map_info& info, int n_threads,
+  std::vector<std::string>& run_rows, std::vector<std::string>& chip_rows)
+{
+  int run_curr = curr.run;
+  std::cout << "Run " << run_curr << "\n";
+
+  noise_map_diff diff;
   {
-    // current noise map
-    std::tuple<int, long, long> info_curr = read_noise_maps(ts_curr, false);
-    int run_curr = std::get<0>(info_curr);
-    long val_from_curr = std::get<1>(info_curr);
-    long val_until_curr = std::get<2>(info_curr);
-
-    // previous noise run
-    std::tuple<int, long, long> info_prev = read_noise_maps(val_from_curr-1, false);
-    int run_prev = std::get<0>(info_prev);
-    long val_from_prev = std::get<1>(info_prev);
-    long val_until_prev = std::get<2>(info_prev);
-
-    std::string fname_curr = Form("noise_maps/%i.root", run_curr);
-    std::string fname_prev = Form("noise_maps/%i.root", run_prev);
-    bool exists_curr = !gSystem->AccessPathName(fname_curr.data());
-    bool exists_prev = !gSystem->AccessPathName(fname_prev.data());
-    if(exists_curr && exists_prev) 
-    {
-      std::cout << "Run " << run_curr << "\n";
+    scoped_timer t(timing, stage_diff, run_curr);
+    diff = diff_noise_maps(curr, prev);
+  }
+  int noisy_total = diff.total;
+  int noisy_new = diff.new_pixs;
+  int noisy_disapp = diff.disapp;
+  std::cout << " Total: " << noisy_total << "\n"
+            << " New: " << noisy_new << "\n"
+            << " Disappeared: " << noisy_disapp << "\n";
+  for (int chipID = 0; chipID < M::geometry::n_chips; chipID++) {
+    if (diff.chip_total[chipID] || diff.chip_new[chipID] || diff.chip_disapp[chipID]) {
+      chip_rows.push_back(Form("%i,%i,%i,%i,%i", 
+        run_curr, chipID, diff.chip_total[chipID], diff.chip_new[chipID], diff.chip_disapp[chipID]));
+    }
+  }
+  // clusters of all noisy pixels and of the new ones only (isolated hits vs hot regions)
+  noise_map_clusters clusters, clusters_new;
+  {
+    scoped_timer t(timing, stage_clusters, run_curr);
+    clusters = find_clusters(curr, n_threads);
+    std::vector<typename M::key_type> keys_new;
+    std::set_difference(curr.keys.begin(), curr.keys.end(), prev.keys.begin(), prev.keys.end(), 
+      std::back_inserter(keys_new));
+    clusters_new = find_clusters(keys_new.data(), keys_new.size(), n_threads);
+  }
+  std::cout << " Clusters: " << clusters.n_clusters << " (largest: " << clusters.max_size << " pixels)\n"
+            << " New clusters: " << clusters_new.n_clusters << " (isolated: " << clusters_new.size_bins[0] << ")\n";
+  std::string cluster_bins;
+  for (int bin : clusters.size_bins) cluster_bins += Form(",%i", bin);
+  run_rows.push_back(Form("%i,%i,%i,%i,%ld,%ld,%i,%i%s,%i,%i", run_curr, noisy_total, noisy_new, noisy_disapp, 
+    info.val_from, info.val_until, clusters.n_clusters, clusters.max_size, 
+    cluster_bins.data(), clusters_new.n_clusters, clusters_new.size_bins[0]));
+  return;
+}
 
-      TFile *f_curr = TFile::Open(fname_curr.data(), "read");
-      std::vector<std::vector<int>>* pixs_curr;
-      f_curr->GetObject("noisy_pixs", pixs_curr); 
+// the maps are fetched (downloaded, decoded and sparsified) by a pool of n_workers threads,
+// at most max_ahead maps ahead of the diff stage, which consumes them in order
+// append: keep the rows of the existing csvs and only process the noise maps valid after them
+// dense_scan > 0: validation run, every map is downloaded and extracted again and cross-checked with the dense
+// scan on dense_scan threads; a map whose scans differ is not cached and stops the job
+template <typename Api = o2::ccdb::CcdbApi, typename G = mft_geometry>
+void compare_noise_maps (long ts_first, long ts_last, bool append = false,
+  std::string ccdb_url = "http://alice-ccdb.cern.ch", int n_workers = 4, int max_ahead = 16, int dense_scan = 0)
+{
+  typedef basic_noise_map<G> noise_map;
+  gSystem->Exec(Form("mkdir -p %s", G::folder));
+  ROOT::EnableThreadSafety();
+  timing.clear();
+  // both maps of a step have to be fetched before it is consumed; when the previous map of a step is not
+  // the last current one (e.g. overlapping validities), the step after first_needed is (first_needed+1, first_needed+2)
+  max_ahead = std::max(3, max_ahead);
+
+  validity_index index;
+  index.load(index_fname<G>());
+  Api ccdb;
+  ccdb.init(ccdb_url);
+  if (append)
+  {
+    long last_from = last_processed_valid_from(stats_fname<G>(), index);
+    if (last_from >= 0) {
+      // the current Valid-Until of the last processed map: where the next map starts, if there is one yet
+      noise_map_info last = retrieve_noise_map_info<G>(ccdb, last_from);
+      index.add({last.val_from, last.val_until, last.run, last.etag});
+      ts_first = std::max(ts_first, last.val_until+1);
+      std::cout << "Appending to " << stats_fname<G>() << " after run " << last.run << " from timestamp " << ts_first << "\n";
+    }
+    if (ts_first >= ts_last) {
+      index.save(index_fname<G>());
+      std::cout << "No new noise runs to process\n";
+      return;
+    }
+  }
 
-      TFile *f_prev = TFile::Open(fname_prev.data(), "read");
-      std::vector<std::vector<int>>* pixs_prev;
-      f_prev->GetObject("noisy_pixs", pixs_prev); 
+  validity_chain chain = resolve_validity_chain<G>(ccdb, index, ts_first, ts_last);
+  int n_maps = chain.maps.size();
 
-      std::vector<std::vector<int>>::iterator it_curr;
-      std::vector<std::vector<int>>::iterator it_prev;
+  // fetch stage
+  // decoded maps are shared through the cache: the current map of one step is reused
+  // as the previous map of the next step, and the memory is bounded by its capacity
+  basic_noise_map_cache<noise_map> cache(max_ahead + 2);
+  std::vector<int> fetched(n_maps, 0); // 0: pending, 1: ok, -1: failed
+  int next_map = 0;
+  int first_needed = 0; // maps before this one were already consumed
+  bool stop = false;
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  // one connection per worker, initialized one at a time before the pool starts
+  int n_threads = std::max(1, n_workers);
+  std::vector<std::unique_ptr<Api>> ccdb_workers;
+  for (int i = 0; i < n_threads; i++) {
+    ccdb_workers.emplace_back(new Api);
+    ccdb_workers.back()->init(ccdb_url);
+  }
 
-      int common_pixs = 0;
-      for (it_curr = pixs_curr->begin(); it_curr != pixs_curr->end(); it_curr++) 
+  auto worker = [&] (Api& ccdb_worker)
+  {
+    while (true)
+    {
+      int i;
       {
-        int chip_curr = it_curr->at(0);
-        for(it_prev = pixs_prev->begin(); it_prev != pixs_prev->end(); it_prev++) 
-        {
-          int chip_prev = it_prev->at(0);
-          if (chip_prev > chip_curr) continue;
-          
-          int row_curr = it_curr->at(1);
-          int col_curr = it_curr->at(2);
-          int row_prev = it_prev->at(1);
-          int col_prev = it_prev->at(2);
-
-          if ((chip_curr == chip_prev) && (row_curr == row_prev) && (col_curr == col_prev)) common_pixs++;          
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return stop || next_map >= n_maps || next_map < first_needed + max_ahead; });
+        if (stop || next_map >= n_maps) return;
+        i = next_map++;
+      }
+      bool ok = cache.get(chain.maps[i].run) != nullptr;
+      if (!ok) {
+        std::shared_ptr<noise_map> m(new noise_map);
+        try {
+          ok = fetch_noise_map(ccdb_worker, chain.maps[i], *m, dense_scan > 0, dense_scan);
+        } catch (const std::exception& e) {
+          std::cout << e.what() << "\n";
         }
+        if (ok) cache.put(m);
       }
-      int noisy_total = pixs_curr->size();
-      int noisy_new = pixs_curr->size() - common_pixs;
-      int noisy_disapp = pixs_prev->size() - common_pixs;
-      std::cout << " Total: " << noisy_total << "\n"
-                << " New: " << noisy_new << "\n"
-                << " Disappeared: " << noisy_disapp << "\n";
-      noise_run_stats.push_back({run_curr, noisy_total, noisy_new, noisy_disapp});
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        fetched[i] = ok ? 1 : -1;
+      }
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int i = 0; i < n_threads; i++) pool.emplace_back(worker, std::ref(*ccdb_workers[i]));
+
+  // diff stage
+  std::vector<std::string> noise_run_stats;
+  std::vector<std::string> noise_chip_stats; // per-chip breakdown
+  basic_noise_map_history<noise_map> history; // compact history of all processed maps
+  bool history_ok = history.open(history_fname<G>());
+  if (!history_ok) std::cout << "Noise map history disabled\n";
+
+  for (auto step : chain.steps)
+  {
+    bool ok;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&] { return fetched[step.first] && fetched[step.second]; });
+      ok = fetched[step.first] > 0 && fetched[step.second] > 0;
+    }
+    int run_curr = chain.maps[step.second].run;
+    int run_prev = chain.maps[step.first].run;
+    // a map evicted before it was consumed is decoded again from its cache file
+    std::shared_ptr<const noise_map> pixs_curr, pixs_prev;
+    if (ok) {
+      auto reload = [] (int run, noise_map& m) { return load_noise_map(run, m, stage_reload); };
+      pixs_prev = cache.get_or_load(run_prev, reload);
+      pixs_curr = cache.get_or_load(run_curr, reload);
+    }
+    if (pixs_curr && pixs_prev)
+    {
+      noise_step_stats(*pixs_curr, *pixs_prev, chain.maps[step.second], n_workers, noise_run_stats, noise_chip_stats);
+      if (history_ok) history_ok = history.append(*pixs_curr, *pixs_prev);
     }
     else 
     {
@@ -147,24 +608,65 @@ void compare_noise_maps (long ts_first, long ts_last)
       break;
     }
 
-    ts_curr = val_until_curr+1;
-    std::cout << " New timestamp: " << ts_curr << "\n";
+    // the current map is the previous one of the next step
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      first_needed = step.second;
+    }
+    cv.notify_all();
   }
 
-  // create and save the csv
-  ofstream csv("input_noisy_pixs.csv");
-  csv << "run,total,new,disapp\n";
-  for (auto noise : noise_run_stats)
-    csv << noise[0] << "," << noise[1] << "," << noise[2] << "," << noise[3] << "\n";
-  csv.close();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto& t : pool) t.join();
+  // indexed intervals are only used if their maps are cached, a failed fetch is looked up again next time
+  index.save(index_fname<G>());
+  std::pair<long, long> cache_stats = cache.hit_stats();
+  std::cout << "Noise map cache: " << cache_stats.first << " hits, " << cache_stats.second << " misses\n";
+  timing.count("cache_hits", cache_stats.first);
+  timing.count("cache_misses", cache_stats.second);
+  timing.write_csv(timing_fname<G>() + ".csv");
+  timing.write_json(timing_fname<G>() + ".json");
+  timing.print_summary();
+
+  // create and save the csvs
+  write_csv_atomic(stats_fname<G>(), stats_header, noise_run_stats, append);
+  write_csv_atomic(chip_stats_fname<G>(), chip_stats_header, noise_chip_stats, append);
 
   return;
 }
 
-void noisy_pixels_count ()
+// ts_last <= 0: up to now
+// incremental: append the noise runs newer than the last one in input_noisy_pixs.csv (daily updates)
+// ccdb_url: CCDB server, or a local directory in the format of local_ccdb.h
+// detector: "MFT" or "ITS" (same pipeline, geometry and CCDB path chosen at compile time)
+// dense_scan > 0: validate the extraction of every map with the dense scan on dense_scan threads
+void noisy_pixels_count (long ts_first = 1714531157487, long ts_last = 1760266579564, bool incremental = false,
+  std::string ccdb_url = "http://alice-ccdb.cern.ch", int n_workers = 4, std::string detector = "MFT", int dense_scan = 0)
 {
-  api.init("http://alice-ccdb.cern.ch");
+  const int max_ahead = 16;
+  if (ts_last <= 0) {
+    ts_last = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+  bool is_local = ccdb_url.find("://") == std::string::npos;
+  if (!is_local) api.init(ccdb_url);
 
-  compare_noise_maps(1714531157487, 1760266579564);
+  if (detector == "ITS") {
+    if (is_local) {
+      compare_noise_maps<local_ccdb, its_geometry>(ts_first, ts_last, incremental, ccdb_url, n_workers, max_ahead, dense_scan);
+    } else {
+      compare_noise_maps<o2::ccdb::CcdbApi, its_geometry>(ts_first, ts_last, incremental, ccdb_url, n_workers, max_ahead,
+        dense_scan);
+    }
+  } else if (detector == "MFT") {
+    if (is_local) compare_noise_maps<local_ccdb>(ts_first, ts_last, incremental, ccdb_url, n_workers, max_ahead, dense_scan);
+    else compare_noise_maps(ts_first, ts_last, incremental, ccdb_url, n_workers, max_ahead, dense_scan);
+  } else {
+    std::cout << "Unknown detector " << detector << "\n";
+  }
   return;
-}
\ No newline at end of file
+}
@@ -0,0 +1,44 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Standalone executable (mft-noisy-count) around the noisy_pixels_count macro, same arguments in the same order:
+// mft-noisy-count [ts_first] [ts_last] [incremental] [ccdb_url] [n_workers] [detector] [dense_scan]
+
+// cpp headers
+#include <string>
+#include <iostream>
+#include <stdexcept>
+// root headers
+#include "TROOT.h"
+// custom headers
+#include "noisy_pixels_count.cxx"
+
+int main (int argc, char** argv)
+{
+  if (argc > 8 || (argc > 1 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help"))) {
+    std::cout << "Usage: " << argv[0] << " [ts_first] [ts_last] [incremental] [ccdb_url] [n_workers] [detector] [dense_scan]\n"
+              << "  ts_first, ts_last: CCDB timestamps [ms] (ts_last <= 0: up to now)\n"
+              << "  incremental: 0 or 1, ccdb_url: CCDB server or local directory, detector: MFT or ITS\n"
+              << "  dense_scan: threads of the dense scan validating every extraction (0: no validation)\n";
+    return argc > 8;
+  }
+  gROOT->SetBatch(true);
+  try {
+    long ts_first = argc > 1 ? std::stol(argv[1]) : 1714531157487;
+    long ts_last = argc > 2 ? std::stol(argv[2]) : 1760266579564;
+    bool incremental = argc > 3 ? std::stoi(argv[3]) != 0 : false;
+    std::string ccdb_url = argc > 4 ? argv[4] : "http://alice-ccdb.cern.ch";
+    int n_workers = argc > 5 ? std::stoi(argv[5]) : 4;
+    std::string detector = argc > 6 ? argv[6] : "MFT";
+    int dense_scan = argc > 7 ? std::stoi(argv[7]) : 0;
+    noisy_pixels_count(ts_first, ts_last, incremental, ccdb_url, n_workers, detector, dense_scan);
+  } catch (const std::invalid_argument&) {
+    std::cout << "Invalid argument, see " << argv[0] << " --help\n";
+    return 1;
+  } catch (const std::exception& e) {
+    std::cout << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
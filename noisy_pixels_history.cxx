@@ -0,0 +1,52 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Compact history of all cached noise maps: checkpoints plus deltas between consecutive runs
+// (noise_maps/history.nmh), and a check that every run is reconstructed exactly
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <iostream>
+// root headers
+#include "TSystem.h"
+// custom headers
+#include "utilities.h"
+
+// (re)builds noise_maps/history.nmh from the cached maps in the order of the runs
+void noisy_pixels_history (int checkpoint_interval = 20, bool verify = true)
+{
+  std::string fname = "noise_maps/history.nmh";
+  gSystem->Exec(Form("rm -f %s", fname.data()));
+  noise_map_history history;
+  if (!history.open(fname, checkpoint_interval)) return;
+
+  std::vector<int> runs = list_cached_runs();
+  if (runs.empty()) {
+    std::cout << "No cached noise maps found\n";
+    return;
+  }
+  long size_cached = 0;
+  noise_map prev, curr;
+  for (int run : runs) {
+    if (!read_noise_map(noise_map_fname(run), curr)) return;
+    size_cached += sizeof(noise_map_header) + curr.size() * 8;
+    if (!history.append(curr, prev)) return;
+    std::swap(prev, curr);
+  }
+  std::cout << "Stored " << runs.size() << " runs: " << history.file_size() << " bytes ("
+            << size_cached << " bytes as separate maps)\n";
+
+  if (!verify) return;
+  int n_bad = 0;
+  for (int run : runs) {
+    noise_map cached, rec;
+    if (!read_noise_map(noise_map_fname(run), cached) || !history.reconstruct(run, rec) || rec != cached) {
+      std::cout << " Run " << run << " not reconstructed correctly\n";
+      n_bad++;
+    }
+  }
+  std::cout << "Verified: " << runs.size() - n_bad << "/" << runs.size() << " runs reconstructed exactly\n";
+  return;
+}
@@ -0,0 +1,81 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Static noise masks from the cached noise maps of a range of runs: union, intersection or the pixels noisy
+// in at least k of the N runs, optionally only the pixels whose noise levels summed over the runs reach min_noise
+// The maps are memory-mapped and streamed through merge_noise_maps; the mask is written in the cache format (.nmap),
+// with the summed noise level of each pixel and the last run of the range as its run
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <climits>
+// root headers
+#include "TSystem.h"
+// custom headers
+#include "utilities.h"
+
+// pixels noisy in at least min_runs of the runs with a summed noise level of at least min_noise
+bool build_noise_mask (const std::vector<int>& runs, int min_runs, long min_noise, noise_map& mask,
+  std::string folder = "noise_maps/")
+{
+  std::vector<std::unique_ptr<noise_map_view>> views;
+  std::vector<const uint32_t*> keys;
+  std::vector<const int32_t*> noise;
+  std::vector<size_t> sizes;
+  for (int run : runs) {
+    views.emplace_back(new noise_map_view(noise_map_fname(run, folder)));
+    if (!views.back()->is_open()) return false;
+    keys.push_back(views.back()->keys());
+    noise.push_back(views.back()->noise());
+    sizes.push_back(views.back()->size());
+  }
+  mask = noise_map();
+  mask.run = runs.empty() ? -1 : runs.back();
+  merge_noise_maps(keys, noise, sizes, [&] (uint32_t key, int n_runs, long noise_sum) {
+    if (n_runs < min_runs || noise_sum < min_noise) return;
+    mask.keys.push_back(key);
+    mask.noise.push_back(std::min(noise_sum, (long)INT_MAX));
+  });
+  return true;
+}
+
+// cached runs in [run_min, run_max]
+// mode: union, intersection or atleast (noisy in at least k runs)
+// fname: output file, by default masks/<mode>_<run_min>_<run_max>.nmap
+void noisy_pixels_mask (int run_min, int run_max, std::string mode = "union", int k = 1, long min_noise = 0,
+  std::string fname = "")
+{
+  std::vector<int> runs;
+  for (int run : list_cached_runs()) if (run >= run_min && run <= run_max) runs.push_back(run);
+  if (runs.empty()) {
+    std::cout << "No cached noise maps in runs " << run_min << "-" << run_max << "\n";
+    return;
+  }
+  int min_runs;
+  if (mode == "union") min_runs = 1;
+  else if (mode == "intersection") min_runs = runs.size();
+  else if (mode == "atleast") min_runs = std::max(1, k);
+  else {
+    std::cout << "Unknown mode " << mode << " (union, intersection or atleast)\n";
+    return;
+  }
+  if (fname.empty()) {
+    gSystem->Exec("mkdir -p masks");
+    fname = Form("masks/%s%s_%i_%i.nmap", mode.data(), mode == "atleast" ? std::to_string(min_runs).data() : "",
+      run_min, run_max);
+  }
+
+  auto t_start = std::chrono::steady_clock::now();
+  noise_map mask;
+  if (!build_noise_mask(runs, min_runs, min_noise, mask) || !write_noise_map(mask, fname)) return;
+  double t_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+  std::cout << "Mask of " << runs.size() << " runs (" << runs.front() << "-" << runs.back() << "), noisy in >= "
+            << min_runs << " runs" << (min_noise > 0 ? Form(", summed noise >= %ld", min_noise) : "") << ": "
+            << mask.size() << " pixels in " << t_build << " s -> " << fname << "\n";
+  return;
+}
@@ -0,0 +1,340 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Per-pixel persistence across all cached noise maps:
+// for every pixel that was noisy at least once, the set of noise runs in which it was noisy
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+// root headers
+#include "TSystem.h"
+// custom headers
+#include "utilities.h"
+
+// compressed set of run indices (roaring-style): the indices are split by their upper 16 bits into containers,
+// a container holds the lower 16 bits as a sorted array up to 4096 entries, as a 65536-bit bitset above
+class run_bitmap
+{
+ public:
+  void add (uint32_t i)
+  {
+    container& c = get_container(i >> 16);
+    uint16_t low = i & 0xffff;
+    if (c.bits.empty()) {
+      auto it = std::lower_bound(c.array.begin(), c.array.end(), low);
+      if (it != c.array.end() && *it == low) return;
+      c.array.insert(it, low); // runs are usually added in increasing order: an append
+      c.card++;
+      if (c.card > max_array) to_bitset(c);
+    } else if (!(c.bits[low >> 6] & (1ull << (low & 63)))) {
+      c.bits[low >> 6] |= 1ull << (low & 63);
+      c.card++;
+    }
+  }
+
+  bool contains (uint32_t i) const
+  {
+    const container* c = find_container(i >> 16);
+    if (!c) return false;
+    uint16_t low = i & 0xffff;
+    if (c->bits.empty()) return std::binary_search(c->array.begin(), c->array.end(), low);
+    return c->bits[low >> 6] & (1ull << (low & 63));
+  }
+
+  uint32_t cardinality () const
+  {
+    uint32_t n = 0;
+    for (auto const& c : mContainers) n += c.card;
+    return n;
+  }
+
+  bool empty () const { return mContainers.empty(); }
+
+  // call f(i) for all indices, in increasing order
+  template<typename F>
+  void for_each (F f) const
+  {
+    for (auto const& c : mContainers) {
+      uint32_t high = (uint32_t)c.high << 16;
+      if (c.bits.empty()) {
+        for (uint16_t low : c.array) f(high | low);
+      } else {
+        for (int w = 0; w < 1024; w++) {
+          for (uint64_t word = c.bits[w]; word; word &= word - 1) f(high | (w << 6) | __builtin_ctzll(word));
+        }
+      }
+    }
+  }
+
+  uint32_t min () const
+  {
+    const container& c = mContainers.front();
+    if (c.bits.empty()) return ((uint32_t)c.high << 16) | c.array.front();
+    int w = 0;
+    while (!c.bits[w]) w++;
+    return ((uint32_t)c.high << 16) | (w << 6) | __builtin_ctzll(c.bits[w]);
+  }
+
+  uint32_t max () const
+  {
+    const container& c = mContainers.back();
+    if (c.bits.empty()) return ((uint32_t)c.high << 16) | c.array.back();
+    int w = 1023;
+    while (!c.bits[w]) w--;
+    return ((uint32_t)c.high << 16) | (w << 6) | (63 - __builtin_clzll(c.bits[w]));
+  }
+
+  // number of noisy <-> not noisy changes between consecutive run indices 0, ..., n_runs-1
+  int transitions (uint32_t n_runs) const
+  {
+    if (empty()) return 0;
+    int segments = 0; // blocks of consecutive indices
+    long prev = -2;
+    for_each([&](uint32_t i) { if ((long)i != prev + 1) segments++; prev = i; });
+    return 2 * segments - (min() == 0) - (max() == n_runs - 1);
+  }
+
+  bool write (FILE* f) const
+  {
+    uint32_t n = mContainers.size();
+    bool ok = std::fwrite(&n, sizeof(n), 1, f) == 1;
+    for (auto const& c : mContainers) {
+      uint8_t is_bitset = !c.bits.empty();
+      ok = ok && std::fwrite(&c.high, sizeof(c.high), 1, f) == 1
+        && std::fwrite(&is_bitset, sizeof(is_bitset), 1, f) == 1
+        && std::fwrite(&c.card, sizeof(c.card), 1, f) == 1;
+      if (is_bitset) ok = ok && std::fwrite(c.bits.data(), sizeof(uint64_t), 1024, f) == 1024;
+      else ok = ok && std::fwrite(c.array.data(), sizeof(uint16_t), c.card, f) == c.card;
+      if (!ok) break;
+    }
+    return ok;
+  }
+
+  bool read (FILE* f)
+  {
+    uint32_t n;
+    if (std::fread(&n, sizeof(n), 1, f) != 1) return false;
+    mContainers.resize(n);
+    for (auto& c : mContainers) {
+      uint8_t is_bitset;
+      if (std::fread(&c.high, sizeof(c.high), 1, f) != 1 || std::fread(&is_bitset, sizeof(is_bitset), 1, f) != 1 
+        || std::fread(&c.card, sizeof(c.card), 1, f) != 1) return false;
+      if (is_bitset) {
+        c.bits.resize(1024);
+        if (std::fread(c.bits.data(), sizeof(uint64_t), 1024, f) != 1024) return false;
+      } else {
+        c.array.resize(c.card);
+        if (std::fread(c.array.data(), sizeof(uint16_t), c.card, f) != c.card) return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static const uint32_t max_array = 4096;
+
+  struct container
+  {
+    uint16_t high = 0;
+    uint32_t card = 0;
+    std::vector<uint16_t> array; // used while bits is empty
+    std::vector<uint64_t> bits;
+  };
+
+  container& get_container (uint16_t high)
+  {
+    if (mContainers.empty() || mContainers.back().high < high) {
+      mContainers.emplace_back();
+      mContainers.back().high = high;
+      return mContainers.back();
+    }
+    auto it = std::lower_bound(mContainers.begin(), mContainers.end(), high, 
+      [](const container& c, uint16_t h) { return c.high < h; });
+    if (it == mContainers.end() || it->high != high) {
+      it = mContainers.insert(it, container());
+      it->high = high;
+    }
+    return *it;
+  }
+
+  const container* find_container (uint16_t high) const
+  {
+    auto it = std::lower_bound(mContainers.begin(), mContainers.end(), high, 
+      [](const container& c, uint16_t h) { return c.high < h; });
+    return (it == mContainers.end() || it->high != high) ? nullptr : &(*it);
+  }
+
+  static void to_bitset (container& c)
+  {
+    c.bits.assign(1024, 0);
+    for (uint16_t low : c.array) c.bits[low >> 6] |= 1ull << (low & 63);
+    std::vector<uint16_t>().swap(c.array);
+  }
+
+  std::vector<container> mContainers; // sorted by high
+};
+
+// pixel key -> runs in which the pixel was noisy
+struct persistence_index
+{
+  std::vector<int> runs; // run numbers, in increasing order (the bitmaps store positions in this vector)
+  std::vector<uint32_t> keys; // sorted pixel keys
+  std::vector<run_bitmap> bitmaps; // one per key
+
+  // nullptr if the pixel was never noisy
+  const run_bitmap* find (uint32_t key) const
+  {
+    auto it = std::lower_bound(keys.begin(), keys.end(), key);
+    return (it == keys.end() || *it != key) ? nullptr : &bitmaps[it - keys.begin()];
+  }
+
+  // pixels noisy in at least a fraction min_fraction of the runs
+  std::vector<uint32_t> noisy_in_fraction (float min_fraction) const
+  {
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (bitmaps[i].cardinality() >= min_fraction * runs.size()) result.push_back(keys[i]);
+    }
+    return result;
+  }
+
+  // run numbers of the first and the last appearance
+  bool first_last (uint32_t key, int& first, int& last) const
+  {
+    const run_bitmap* b = find(key);
+    if (!b) return false;
+    first = runs[b->min()];
+    last = runs[b->max()];
+    return true;
+  }
+
+  // pixels switching between noisy and not noisy at least min_transitions times
+  std::vector<uint32_t> flapping (int min_transitions) const
+  {
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (bitmaps[i].transitions(runs.size()) >= min_transitions) result.push_back(keys[i]);
+    }
+    return result;
+  }
+};
+
+// one pass over the cached maps, in the order of the run numbers
+bool build_persistence_index (persistence_index& index, std::string folder = "noise_maps/")
+{
+  index = persistence_index();
+  index.runs = list_cached_runs(folder);
+  std::unordered_map<uint32_t, run_bitmap> bitmaps;
+  for (size_t r = 0; r < index.runs.size(); r++) {
+    noise_map_view m(noise_map_fname(index.runs[r], folder));
+    if (!m.is_open()) return false;
+    for (size_t i = 0; i < m.size(); i++) bitmaps[m.keys()[i]].add(r);
+  }
+  index.keys.reserve(bitmaps.size());
+  for (auto const& item : bitmaps) index.keys.push_back(item.first);
+  std::sort(index.keys.begin(), index.keys.end());
+  index.bitmaps.reserve(index.keys.size());
+  for (uint32_t key : index.keys) index.bitmaps.push_back(std::move(bitmaps[key]));
+  std::cout << "Persistence index built: " << index.runs.size() << " noise maps, " 
+            << index.keys.size() << " pixels noisy at least once\n";
+  return true;
+}
+
+// file format: n_runs, runs[n_runs], n_keys, keys[n_keys], then the bitmaps in the order of the keys
+// written to a temporary file and moved over fname, so an interrupted write never leaves a truncated index
+bool write_persistence_index (const persistence_index& index, std::string fname)
+{
+  std::string fname_tmp = fname + ".tmp";
+  FILE* f = std::fopen(fname_tmp.data(), "wb");
+  if (!f) {
+    std::cout << "Cannot open " << fname_tmp << "\n";
+    return false;
+  }
+  uint32_t n_runs = index.runs.size();
+  uint32_t n_keys = index.keys.size();
+  bool ok = std::fwrite(&n_runs, sizeof(n_runs), 1, f) == 1
+    && std::fwrite(index.runs.data(), sizeof(int), n_runs, f) == n_runs
+    && std::fwrite(&n_keys, sizeof(n_keys), 1, f) == 1
+    && std::fwrite(index.keys.data(), sizeof(uint32_t), n_keys, f) == n_keys;
+  for (auto const& b : index.bitmaps) ok = ok && b.write(f);
+  ok = std::fclose(f) == 0 && ok;
+  if (!ok || std::rename(fname_tmp.data(), fname.data()) != 0) {
+    std::remove(fname_tmp.data());
+    std::cout << "Cannot write " << fname << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool read_persistence_index (persistence_index& index, std::string fname)
+{
+  FILE* f = std::fopen(fname.data(), "rb");
+  if (!f) {
+    std::cout << "Cannot open " << fname << "\n";
+    return false;
+  }
+  uint32_t n_runs, n_keys;
+  bool ok = std::fread(&n_runs, sizeof(n_runs), 1, f) == 1;
+  if (ok) {
+    index.runs.resize(n_runs);
+    ok = std::fread(index.runs.data(), sizeof(int), n_runs, f) == n_runs;
+  }
+  ok = ok && std::fread(&n_keys, sizeof(n_keys), 1, f) == 1;
+  if (ok) {
+    index.keys.resize(n_keys);
+    index.bitmaps.resize(n_keys);
+    ok = std::fread(index.keys.data(), sizeof(uint32_t), n_keys, f) == n_keys;
+  }
+  for (uint32_t i = 0; ok && i < n_keys; i++) ok = index.bitmaps[i].read(f);
+  std::fclose(f);
+  if (!ok) std::cout << "Corrupted persistence index " << fname << "\n";
+  return ok;
+}
+
+// builds (or with rebuild = false, reads) noise_maps/persistence.idx and writes the per-pixel summary
+// persistence.csv plus the lists of pixels noisy in >= min_fraction of the runs and of flapping pixels
+void noisy_pixels_persistence (float min_fraction = 0.9, int min_transitions = 10, bool rebuild = true)
+{
+  std::string fname = "noise_maps/persistence.idx";
+  persistence_index index;
+  if (rebuild || !read_persistence_index(index, fname)) {
+    if (!build_persistence_index(index)) return;
+    write_persistence_index(index, fname);
+  }
+  if (index.runs.empty()) {
+    std::cout << "No cached noise maps found\n";
+    return;
+  }
+
+  std::ofstream csv("persistence.csv");
+  csv << "chip,row,col,runs,fraction,first_run,last_run,transitions\n";
+  for (size_t i = 0; i < index.keys.size(); i++) {
+    uint32_t key = index.keys[i];
+    const run_bitmap& b = index.bitmaps[i];
+    csv << key_chip(key) << "," << key_row(key) << "," << key_col(key) << "," 
+        << b.cardinality() << "," << (float)b.cardinality() / index.runs.size() << ","
+        << index.runs[b.min()] << "," << index.runs[b.max()] << "," << b.transitions(index.runs.size()) << "\n";
+  }
+  csv.close();
+
+  std::vector<uint32_t> persistent = index.noisy_in_fraction(min_fraction);
+  std::vector<uint32_t> flapping = index.flapping(min_transitions);
+  std::ofstream csv_persistent("persistence_persistent.csv");
+  csv_persistent << "chip,row,col\n";
+  for (uint32_t key : persistent) csv_persistent << key_chip(key) << "," << key_row(key) << "," << key_col(key) << "\n";
+  csv_persistent.close();
+  std::ofstream csv_flapping("persistence_flapping.csv");
+  csv_flapping << "chip,row,col\n";
+  for (uint32_t key : flapping) csv_flapping << key_chip(key) << "," << key_row(key) << "," << key_col(key) << "\n";
+  csv_flapping.close();
+
+  std::cout << " Noisy in >= " << min_fraction * 100 << "% of the runs: " << persistent.size() << " pixels\n"
+            << " Flapping (>= " << min_transitions << " transitions): " << flapping.size() << " pixels\n";
+  return;
+}
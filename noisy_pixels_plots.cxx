@@ -4,22 +4,34 @@
 
 // cpp headers
 #include <sstream>
+#include <cstdlib>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <array>
+#include <sys/wait.h>
+#include <unistd.h>
 // root headers
+#include "TROOT.h"
 #include "TSystem.h"
+#include "TFile.h"
 #include "TStyle.h"
 #include "TH1.h"
 #include "TH2.h"
+#include "TF1.h"
 #include "TGraph.h"
 #include "TCanvas.h"
 #include "TPad.h"
 #include "TGaxis.h"
 #include "TLegend.h"
+#include "TLatex.h"
 // custom headers
 #include "utilities.h"
 
-bool first_execution(true);
-float xmin(-1), xmax(-1);
-
 template<typename TH>
 void format_histo (TH* h)
 {
@@ -51,80 +63,254 @@ void format_graph (TGraph* g, Color_t clr, Style_t lst, Style_t mrk)
   return;
 }
 
-void noisy_pix_correlation_with_delays (std::vector<noise>* noise_runs, std::string folder = "")
+// objects drawn for one plot, deleted with it once it is printed
+// (the watch mode redraws the plots on every poll: nothing may be left behind in memory or in gROOT's lists)
+class plot_objects
 {
-  // axes and ranges
-  const int N_2d = 5;
-  float ax_5bins[N_2d+1] = {0, 1, 2, 3, 4, 5};
-  float ax_sb_2d[N_2d+1] = {0, 10, 30, 60, 600, 1e5};
-  float ax_re_2d[N_2d+1] = {0, 10, 30, 60, 600, 1e5};
-
-  const int N_sb = 8;
-  double ax_8bins[N_sb+1] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
-  double ax_sb_1d[N_sb+1] = {0, 5, 10, 15, 30, 60, 120, 480, 1e4};
-
-  const int N_re = 7;
-  double ax_7bins[N_re+1] = {0, 1, 2, 3, 4, 5, 6, 7};
-  double ax_re_1d[N_re+1] = {0, 5, 10, 60, 120, 360, 720, 1e4};
-
-  // histograms
-  TH2F* h2_true_total = new TH2F("", "", N_2d, &ax_sb_2d[0], N_2d, &ax_re_2d[0]);
-  TH2I* h2_true_count = new TH2I("", "", N_2d, &ax_sb_2d[0], N_2d, &ax_re_2d[0]);
-
-  TH2F* h2_bins_total = new TH2F("", Form("#Noisy pixels (#color[4]{#runs, total: %lu})", noise_runs->size()), N_2d, &ax_5bins[0], N_2d, &ax_5bins[0]);
-  TH2I* h2_bins_count = new TH2I("", "#Runs", N_2d, &ax_5bins[0], N_2d, &ax_5bins[0]);
-
-  TH1F* h1_true_total_sb = new TH1F("", "", N_sb, &ax_sb_1d[0]);
-  TH1I* h1_true_count_sb = new TH1I("", "", N_sb, &ax_sb_1d[0]);
-  TH1F* h1_bins_total_sb = new TH1F("", "#Noisy pixels", N_sb, &ax_8bins[0]);
-
-  TH1F* h1_true_total_re = new TH1F("", "", N_re, &ax_re_1d[0]);
-  TH1I* h1_true_count_re = new TH1I("", "", N_re, &ax_re_1d[0]);
-  TH1F* h1_bins_total_re = new TH1F("", "#Noisy pixels", N_re, &ax_7bins[0]);
-
-  // fill the true histograms
-  for (auto n : *noise_runs) {
-    float delay_sb = (std::get<0>(n.timestamps) - std::get<1>(n.timestamps)) / 60; // in minutes
-    float delay_re = (std::get<0>(n.timestamps) - std::get<2>(n.timestamps)) / 60; // in minutes
-    h2_true_total->Fill(delay_sb, delay_re, std::get<0>(n.noisy_pixels));
-    h2_true_count->Fill(delay_sb, delay_re);
-    h1_true_total_sb->Fill(delay_sb, std::get<0>(n.noisy_pixels));
-    h1_true_count_sb->Fill(delay_sb);
-    h1_true_total_re->Fill(delay_re, std::get<0>(n.noisy_pixels));
-    h1_true_count_re->Fill(delay_re);
-  }
-
-  // fill the bin histograms
-  for (int x = 1; x <= N_2d; x++) {
-    for (int y = 1; y <= N_2d; y++) {
-      int entries = h2_true_count->GetBinContent(x, y);
-      if (entries > 0) {
-        h2_bins_total->SetBinContent(x, y, h2_true_total->GetBinContent(x, y) / entries);
-        h2_bins_count->SetBinContent(x, y, entries);
-      }
+ public:
+  // deleted in reverse order: the primitives before the pads and canvases they are drawn on
+  ~plot_objects () { while (!mObjects.empty()) mObjects.pop_back(); }
+
+  template <typename T>
+  T* add (T* obj)
+  {
+    mObjects.emplace_back(obj);
+    return obj;
+  }
+
+ private:
+  std::vector<std::unique_ptr<TObject>> mObjects;
+};
+
+// single-pass (Welford) mean, variance, min and max of a sample; two samples are merged exactly
+struct running_stats
+{
+  long n = 0;
+  double mean = 0;
+  double m2 = 0; // sum of squared deviations from the mean
+  double min = std::numeric_limits<double>::max();
+  double max = std::numeric_limits<double>::lowest();
+
+  void add (double x)
+  {
+    n++;
+    double delta = x - mean;
+    mean += delta / n;
+    m2 += delta * (x - mean);
+    min = std::min(min, x);
+    max = std::max(max, x);
+  }
+
+  void add (const running_stats& o)
+  {
+    if (o.n == 0) return;
+    long n_tot = n + o.n;
+    double delta = o.mean - mean;
+    mean += delta * o.n / n_tot;
+    m2 += o.m2 + delta * delta * n * o.n / n_tot;
+    n = n_tot;
+    min = std::min(min, o.min);
+    max = std::max(max, o.max);
+  }
+
+  double variance () const { return n > 1 ? m2 / (n - 1) : 0; }
+  double std_dev () const { return std::sqrt(variance()); }
+  double mean_error () const { return n > 0 ? std::sqrt(variance() / n) : 0; }
+};
+
+// variable-width bins [edges[i], edges[i+1]); the bin of a value is looked up in a table of equal cells
+// (the bin of the lower edge of each cell) followed by a few comparisons, values outside the edges give -1
+class binning
+{
+ public:
+  binning () = default;
+  binning (std::vector<double> edges, int n_cells = 1024) : mEdges(edges)
+  {
+    std::sort(mEdges.begin(), mEdges.end());
+    if (mEdges.size() < 2) return;
+    mScale = n_cells / (mEdges.back() - mEdges.front());
+    mCells.resize(n_cells);
+    int bin = 0;
+    for (int c = 0; c < n_cells; c++) {
+      double x = mEdges.front() + c / mScale;
+      while (bin + 1 < n_bins() && x >= mEdges[bin + 1]) bin++;
+      mCells[c] = bin;
     }
   }
-  for (int x = 1; x <= N_sb; x++) {
-    int entries = h1_true_count_sb->GetBinContent(x);
-    if (entries > 0) h1_bins_total_sb->SetBinContent(x, h1_true_total_sb->GetBinContent(x) / entries);
+
+  int n_bins () const { return std::max(0, (int)mEdges.size() - 1); }
+  const std::vector<double>& edges () const { return mEdges; }
+
+  int find (double x) const
+  {
+    if (mCells.empty() || !(x >= mEdges.front() && x < mEdges.back())) return -1;
+    int bin = mCells[std::min((size_t)((x - mEdges.front()) * mScale), mCells.size() - 1)];
+    while (bin + 1 < n_bins() && x >= mEdges[bin + 1]) bin++;
+    return bin;
+  }
+
+ private:
+  std::vector<double> mEdges;
+  std::vector<int> mCells;
+  double mScale = 0;
+};
+
+// running_stats of a value per bin of one or two variables (x only if the y binning is empty)
+// accumulators filled on separate chunks of the data with the same binning can be merged
+class binned_stats
+{
+ public:
+  binned_stats (binning x, binning y = binning()) : mX(x), mY(y),
+    mBins(std::max(1, x.n_bins()) * std::max(1, y.n_bins())) {}
+
+  void fill (double x, double value)
+  {
+    int ix = mX.find(x);
+    if (ix >= 0) mBins[ix].add(value);
+  }
+
+  void fill (double x, double y, double value)
+  {
+    int ix = mX.find(x);
+    int iy = mY.find(y);
+    if (ix >= 0 && iy >= 0) mBins[iy * mX.n_bins() + ix].add(value);
+  }
+
+  void add (const binned_stats& o)
+  {
+    for (size_t i = 0; i < mBins.size() && i < o.mBins.size(); i++) mBins[i].add(o.mBins[i]);
   }
-  for (int x = 1; x <= N_re; x++) {
-    int entries = h1_true_count_re->GetBinContent(x);
-    if (entries > 0) h1_bins_total_re->SetBinContent(x, h1_true_total_re->GetBinContent(x) / entries);
+
+  const running_stats& at (int ix, int iy = 0) const { return mBins[iy * mX.n_bins() + ix]; }
+  const binning& x () const { return mX; }
+  const binning& y () const { return mY; }
+
+ private:
+  binning mX, mY;
+  std::vector<running_stats> mBins;
+};
+
+// bin labels "[low, high)", the last bin as ">= low" (its upper edge only closes the range)
+void set_bin_labels (TAxis* ax, const binning& b)
+{
+  const std::vector<double>& e = b.edges();
+  for (int i = 1; i < b.n_bins(); i++) ax->SetBinLabel(i, Form("[%.0f, %.0f)", e[i-1], e[i]));
+  ax->SetBinLabel(b.n_bins(), Form(">= %.0f", e[b.n_bins()-1]));
+  return;
+}
+
+// number of noisy pixels in bins of the time since last SB stop and since last GO_READY (2d and 1d)
+struct delay_correlation
+{
+  binned_stats s2, s_sb, s_re;
+  size_t n_runs;
+
+  void add (const noise_run_table& noise_runs, size_t i)
+  {
+    float delay_sb = noise_runs.delay_sb[i]; // in minutes
+    float delay_re = noise_runs.delay_re[i]; // in minutes
+    s2.fill(delay_sb, delay_re, noise_runs.total[i]);
+    s_sb.fill(delay_sb, noise_runs.total[i]);
+    s_re.fill(delay_re, noise_runs.total[i]);
+    n_runs++;
   }
+};
+
+// bin edges of the delay correlations [minutes]
+struct delay_binning
+{
+  std::vector<double> sb_2d = {0, 10, 30, 60, 600, 1e5};
+  std::vector<double> re_2d = {0, 10, 30, 60, 600, 1e5};
+  std::vector<double> sb_1d = {0, 5, 10, 15, 30, 60, 120, 480, 1e4};
+  std::vector<double> re_1d = {0, 5, 10, 60, 120, 360, 720, 1e4};
+};
+
+// "sb_1d=0,5,10,60;re_2d=0,30,1e5": the given binnings replace the default ones
+bool parse_delay_binning (std::string spec, delay_binning& bins)
+{
+  std::stringstream ss(spec);
+  std::string item;
+  while (std::getline(ss, item, ';')) {
+    if (item.empty()) continue;
+    size_t eq = item.find('=');
+    std::string name = item.substr(0, eq);
+    std::vector<double>* edges = name == "sb_2d" ? &bins.sb_2d : name == "re_2d" ? &bins.re_2d
+      : name == "sb_1d" ? &bins.sb_1d : name == "re_1d" ? &bins.re_1d : nullptr;
+    std::vector<double> values;
+    std::stringstream ss_values(eq == std::string::npos ? "" : item.substr(eq + 1));
+    std::string value;
+    while (std::getline(ss_values, value, ',')) {
+      char* end = nullptr;
+      double v = std::strtod(value.data(), &end);
+      if (value.empty() || *end) break;
+      values.push_back(v);
+    }
+    bool increasing = std::adjacent_find(values.begin(), values.end(), std::greater_equal<double>()) == values.end();
+    if (!edges || values.size() < 2 || values.size() != (size_t)std::count(item.begin(), item.end(), ',') + 1
+      || !increasing) {
+      std::cout << "Invalid delay binning " << item << " (expected sb_2d, re_2d, sb_1d or re_1d=e0,e1,...)\n";
+      return false;
+    }
+    *edges = values;
+  }
+  return true;
+}
+
+// one pass over the runs
+delay_correlation compute_delay_correlation (const noise_run_table& noise_runs, const delay_binning& bins = delay_binning())
+{
+  delay_correlation corr{binned_stats{binning(bins.sb_2d), binning(bins.re_2d)}, binned_stats{binning(bins.sb_1d)},
+    binned_stats{binning(bins.re_1d)}, 0};
+  for (size_t i = 0; i < noise_runs.size(); i++) corr.add(noise_runs, i);
+  return corr;
+}
+
+// mean number of noisy pixels (with the error of the mean) per bin
+void draw_delay_correlation (const delay_correlation& corr, std::string folder = "")
+{
+  plot_objects objs;
+  const binned_stats& s2 = corr.s2;
+  const binned_stats& s_sb = corr.s_sb;
+  const binned_stats& s_re = corr.s_re;
+
+  // histograms with one unit-width bin per delay bin
+  int N_sb_2d = s2.x().n_bins();
+  int N_re_2d = s2.y().n_bins();
+  TH2F* h2_bins_total = objs.add(new TH2F("", Form("#Noisy pixels (#color[4]{#runs, total: %lu})", corr.n_runs), N_sb_2d, 0, N_sb_2d, N_re_2d, 0, N_re_2d));
+  TH2I* h2_bins_count = objs.add(new TH2I("", "#Runs", N_sb_2d, 0, N_sb_2d, N_re_2d, 0, N_re_2d));
+  for (TH1* h : {(TH1*)h2_bins_total, (TH1*)h2_bins_count}) h->SetDirectory(nullptr);
+  for (int x = 0; x < N_sb_2d; x++) {
+    for (int y = 0; y < N_re_2d; y++) {
+      const running_stats& bin = s2.at(x, y);
+      if (bin.n > 0) {
+        h2_bins_total->SetBinContent(x+1, y+1, bin.mean);
+        h2_bins_total->SetBinError(x+1, y+1, bin.mean_error());
+        h2_bins_count->SetBinContent(x+1, y+1, bin.n);
+      }
+    }
+  }
+  auto make_1d = [&] (const binned_stats& s) {
+    int n = s.x().n_bins();
+    TH1F* h = objs.add(new TH1F("", "#Noisy pixels", n, 0, n));
+    h->SetDirectory(nullptr);
+    for (int x = 0; x < n; x++) {
+      if (s.at(x).n == 0) continue;
+      h->SetBinContent(x+1, s.at(x).mean);
+      h->SetBinError(x+1, s.at(x).mean_error());
+    }
+    return h;
+  };
+  TH1F* h1_bins_total_sb = make_1d(s_sb);
+  TH1F* h1_bins_total_re = make_1d(s_re);
 
   // 2d correlation plot
-  TCanvas* c1 = new TCanvas("", "", 900, 700);
+  TCanvas* c1 = objs.add(new TCanvas("", "", 900, 700));
   set_margins(c1, 0.07, 0.12, 0.10, 0.145);
 
   // h2_total
   // axis labels
-  for(int i = 1; i < N_2d; i++) {
-    h2_bins_total->GetXaxis()->SetBinLabel(i, Form("[%.0f, %.0f)", ax_sb_2d[i-1], ax_sb_2d[i]));
-    h2_bins_total->GetYaxis()->SetBinLabel(i, Form("[%.0f, %.0f)", ax_re_2d[i-1], ax_re_2d[i]));
-  }
-  h2_bins_total->GetXaxis()->SetBinLabel(N_2d, Form(">= %.0f", ax_sb_2d[N_2d-1]));
-  h2_bins_total->GetYaxis()->SetBinLabel(N_2d, Form(">= %.0f", ax_re_2d[N_2d-1]));
+  set_bin_labels(h2_bins_total->GetXaxis(), s2.x());
+  set_bin_labels(h2_bins_total->GetYaxis(), s2.y());
   // x-axis
   h2_bins_total->GetXaxis()->SetTitle("Time since last SB stop [min]");
   h2_bins_total->GetXaxis()->SetTitleSize(0.035);
@@ -152,51 +338,320 @@ void noisy_pix_correlation_with_delays (std::vector<noise>* noise_runs, std::str
   h2_bins_count->Draw("same text");
   c1->Print(Form("%scorr_2d.pdf", folder.data()));
 
-  TCanvas* c2 = new TCanvas("", "", 900, 700);
+  // error bars: error of the mean in each bin
+  TCanvas* c2 = objs.add(new TCanvas("", "", 900, 700));
   set_margins(c2, 0.07, 0.02, 0.10, 0.12);
   format_histo(h1_bins_total_sb);
   h1_bins_total_sb->GetXaxis()->SetTitle("Time since last SB stop [min]");
-  for(int i = 1; i < N_sb; i++) h1_bins_total_sb->GetXaxis()->SetBinLabel(i, Form("[%.0f, %.0f)", ax_sb_1d[i-1], ax_sb_1d[i]));
-  h1_bins_total_sb->GetXaxis()->SetBinLabel(N_sb, Form(">= %.0f", ax_sb_1d[N_sb-1]));
+  set_bin_labels(h1_bins_total_sb->GetXaxis(), s_sb.x());
   h1_bins_total_sb->Draw("e0");
   c2->Print(Form("%scorr_sb_stop.pdf", folder.data()));
 
-  TCanvas* c3 = new TCanvas("", "", 900, 700);
+  TCanvas* c3 = objs.add(new TCanvas("", "", 900, 700));
   set_margins(c3, 0.07, 0.02, 0.10, 0.12);
   format_histo(h1_bins_total_re);
   h1_bins_total_re->GetXaxis()->SetTitle("Time since last GO_READY [min]");
-  for(int i = 1; i < N_re; i++) h1_bins_total_re->GetXaxis()->SetBinLabel(i, Form("[%.0f, %.0f)", ax_re_1d[i-1], ax_re_1d[i]));
-  h1_bins_total_re->GetXaxis()->SetBinLabel(N_re, Form(">= %.0f", ax_re_1d[N_re-1]));
+  set_bin_labels(h1_bins_total_re->GetXaxis(), s_re.x());
   h1_bins_total_re->Draw("e0");
   c3->Print(Form("%scorr_go_ready.pdf", folder.data()));
 
   return;
 }
 
-void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
-  std::tuple<float, float, float, float> delays = {0, 1e4, 0, 1e4}, // sb_min, sb_max, re_min, re_max
-  std::tuple<float, float, float, float> force_ranges = {-1, -1, -1, -1},
-  std::string folder = "")
+// delay window: time since last SB stop in [sb_min, sb_max), time since last GO_READY in [re_min, re_max) [minutes]
+typedef std::tuple<float, float, float, float> delay_window; // sb_min, sb_max, re_min, re_max
+
+// indices of the runs inside each of the windows, all windows are filled in one pass over the delays
+std::vector<std::vector<int>> select_runs (const noise_run_table& noise_runs, const std::vector<delay_window>& windows)
+{
+  int n_windows = windows.size();
+  std::vector<float> sb_min(n_windows), sb_max(n_windows), re_min(n_windows), re_max(n_windows);
+  for (int w = 0; w < n_windows; w++) std::tie(sb_min[w], sb_max[w], re_min[w], re_max[w]) = windows[w];
+
+  std::vector<std::vector<int>> selected(n_windows);
+  for (auto& sel : selected) sel.reserve(noise_runs.size());
+  for (size_t i = 0; i < noise_runs.size(); i++) {
+    float delay_sb = noise_runs.delay_sb[i]; // in minutes
+    float delay_re = noise_runs.delay_re[i]; // in minutes
+    for (int w = 0; w < n_windows; w++) {
+      if(  (delay_sb >= sb_min[w]) && (delay_sb < sb_max[w]) 
+        && (delay_re >= re_min[w]) && (delay_re < re_max[w]) ) selected[w].push_back(i);
+    }
+  }
+  return selected;
+}
+
+// cumulative sums for a straight-line least-squares fit y = a + b*x
+struct regression_sums
+{
+  double n = 0, sx = 0, sy = 0, sxy = 0, sxx = 0, syy = 0;
+
+  void add (double x, double y) { n++; sx += x; sy += y; sxy += x*y; sxx += x*x; syy += y*y; }
+  void add (const regression_sums& o) { n += o.n; sx += o.sx; sy += o.sy; sxy += o.sxy; sxx += o.sxx; syy += o.syy; }
+  void subtract (const regression_sums& o) { n -= o.n; sx -= o.sx; sy -= o.sy; sxy -= o.sxy; sxx -= o.sxx; syy -= o.syy; }
+  void remove (double x, double y) { n--; sx -= x; sy -= y; sxy -= x*y; sxx -= x*x; syy -= y*y; }
+
+  // false if the fit is undefined (fewer than two distinct x)
+  bool fit (double& intercept, double& slope, double& chi2) const
+  {
+    if (n < 2) return false;
+    double var_x = sxx - sx*sx/n;
+    if (var_x <= 0) return false;
+    double cov_xy = sxy - sx*sy/n;
+    slope = cov_xy / var_x;
+    intercept = (sy - slope*sx) / n;
+    chi2 = std::max(0., (syy - sy*sy/n) - slope*cov_xy); // sum of squared residuals (unit errors, as the TGraph fit)
+    return true;
+  }
+};
+
+// straight-line fit over the last n_window points, updated in O(1) per point; the sums are rebuilt from
+// the points once every n_window points so that the rounding errors of the subtractions do not add up
+class rolling_regression
+{
+ public:
+  rolling_regression (int n_window = 20) : mWindow(std::max(3, n_window)) {}
+
+  void push (double x, double y)
+  {
+    mPoints.push_back({x, y});
+    mSums.add(x, y);
+    if ((int)mPoints.size() > mWindow) {
+      mSums.remove(mPoints.front().first, mPoints.front().second);
+      mPoints.pop_front();
+    }
+    if (++mNPushed % mWindow == 0) rebuild();
+  }
+
+  // drops all but the last n points
+  void keep_last (int n)
+  {
+    while ((int)mPoints.size() > std::max(0, n)) mPoints.pop_front();
+    rebuild();
+  }
+
+  int size () const { return mPoints.size(); }
+  const std::pair<double, double>& point (int i) const { return mPoints[i]; }
+  bool fit (double& intercept, double& slope, double& chi2) const { return mSums.fit(intercept, slope, chi2); }
+
+  // value of the fit at x and standard deviation of the residuals (at least three points)
+  bool predict (double x, double& y, double& sigma) const
+  {
+    double intercept, slope, chi2;
+    if (mSums.n < 3 || !fit(intercept, slope, chi2)) return false;
+    y = intercept + slope * x;
+    sigma = std::sqrt(chi2 / (mSums.n - 2));
+    return true;
+  }
+
+ private:
+  void rebuild ()
+  {
+    mSums = regression_sums();
+    for (auto const& p : mPoints) mSums.add(p.first, p.second);
+  }
+
+  int mWindow;
+  long mNPushed = 0;
+  std::deque<std::pair<double, double>> mPoints;
+  regression_sums mSums;
+};
+
+// two-sided Page-Hinkley test of standardized residuals z: an upward shift when the cumulative sum of z - delta
+// rises more than lambda above its minimum, a downward one when the sum of z + delta falls lambda below its maximum
+struct page_hinkley
+{
+  double delta = 0.5, lambda = 10;
+  double sum_up = 0, min_up = 0, sum_down = 0, max_down = 0;
+  int n = 0, n_min_up = 0, n_max_down = 0; // residuals added in total and until the extremes
+  std::deque<double> recent; // last residuals (at most 256)
+
+  // +1 / -1: upward / downward shift, 0: no change
+  int add (double z)
+  {
+    n++;
+    recent.push_back(z);
+    if (recent.size() > 256) recent.pop_front();
+    sum_up += z - delta;
+    sum_down += z + delta;
+    if (sum_up < min_up) { min_up = sum_up; n_min_up = n; }
+    if (sum_down > max_down) { max_down = sum_down; n_max_down = n; }
+    if (sum_up - min_up > lambda) return 1;
+    if (max_down - sum_down > lambda) return -1;
+    return 0;
+  }
+
+  // number of the last residuals which belong to the shift: the extreme of the sum is the first estimate,
+  // refined with the drift allowance set to half of the mean shift (smaller residuals are not part of it)
+  int n_shifted (int sign) const
+  {
+    int n_max = std::min(n - (sign > 0 ? n_min_up : n_max_down), (int)recent.size());
+    int m = n_max;
+    for (int iter = 0; iter < 2 && m > 0; iter++) {
+      double mean = 0;
+      for (int k = 1; k <= m; k++) mean += sign * recent[recent.size() - k];
+      double d = std::max(delta, mean / m / 2);
+      double sum = 0, best = std::numeric_limits<double>::lowest();
+      for (int k = 1; k <= n_max; k++) {
+        sum += sign * recent[recent.size() - k] - d;
+        if (sum > best) { best = sum; m = k; }
+      }
+    }
+    return std::max(1, m);
+  }
+
+  void reset ()
+  {
+    sum_up = min_up = sum_down = max_down = 0;
+    n = n_min_up = n_max_down = 0;
+    recent.clear();
+  }
+};
+
+enum trend_quantity { trend_total, trend_new, trend_disapp, n_trend_quantities };
+const std::vector<std::string> trend_quantity_names = {"total", "new", "disappeared"};
+
+struct trend_config
 {
-  TGraph* gr_trend_total = new TGraph();
-  TGraph* gr_trend_new = new TGraph();
-  TGraph* gr_trend_disapp = new TGraph();
-
-  TF1 *f_total = new TF1("f", "[1]*x + [0]");
-
-  std::vector<int> run_numbers;
-  for (auto n : *noise_runs) {
-    float delay_sb = (std::get<0>(n.timestamps) - std::get<1>(n.timestamps) ) / 60; // in minutes
-    float delay_re = (std::get<0>(n.timestamps) - std::get<2>(n.timestamps) ) / 60; // in minutes
-    if(  (delay_sb >= std::get<0>(delays)) && (delay_sb < std::get<1>(delays)) 
-      && (delay_re >= std::get<2>(delays)) && (delay_re < std::get<3>(delays)) )
-    {
-      run_numbers.push_back(n.run);
-      gr_trend_total->AddPoint(std::get<0>(n.timestamps), std::get<0>(n.noisy_pixels));
-      gr_trend_new->AddPoint(std::get<0>(n.timestamps), std::get<1>(n.noisy_pixels));
-      gr_trend_disapp->AddPoint(std::get<0>(n.timestamps), std::get<2>(n.noisy_pixels));
+  int n_window = 20; // runs in the rolling fits
+  int n_min = 6; // runs in the fit before the residuals are tested
+  double delta = 0.5; // Page-Hinkley drift allowance and threshold, in standard deviations of the residuals
+  double lambda = 10;
+};
+
+struct trend_changepoint
+{
+  int quantity;
+  int row; // first run after the change (row in the noise_run_table)
+  int sign; // +1 increase, -1 decrease
+};
+
+// online trend of the total/new/disappeared noisy pixels: each run is compared with the rolling fit of the previous
+// ones and the standardized residual goes to a Page-Hinkley test; at a change, the fit restarts from the onset
+// of the change. O(1) per run, O(n_window) at a change
+class trend_monitor
+{
+ public:
+  typedef std::vector<std::pair<double, double>> curve; // (trg_start, fitted value)
+
+  trend_monitor (trend_config cfg = trend_config()) : mCfg(cfg)
+  {
+    for (auto& s : mSeries) {
+      s.reg = rolling_regression(cfg.n_window);
+      s.ph.delta = cfg.delta;
+      s.ph.lambda = cfg.lambda;
+      s.curves.resize(1);
+    }
+  }
+
+  // adds row i of the table (the runs in time order), returns the number of new changepoints
+  int add (const noise_run_table& noise_runs, int i)
+  {
+    if (mRows.empty()) mT0 = noise_runs.trg_start[i];
+    mRows.push_back(i);
+    double x = noise_runs.trg_start[i] - mT0; // relative to the first run, to keep the sums precise
+    double y[n_trend_quantities] = {(double)noise_runs.total[i], (double)noise_runs.new_pixs[i], (double)noise_runs.disapp[i]};
+    int n_changes = 0;
+    for (int q = 0; q < n_trend_quantities; q++) {
+      series& s = mSeries[q];
+      double pred, sigma;
+      int sign = 0;
+      if (s.reg.size() >= mCfg.n_min && s.reg.predict(x, pred, sigma)) sign = s.ph.add((y[q] - pred) / std::max(sigma, 1.));
+      s.reg.push(x, y[q]);
+      if (sign) {
+        int n_after = std::min(s.ph.n_shifted(sign), (int)mRows.size());
+        int onset = mRows[mRows.size() - n_after];
+        mChanges.push_back({q, onset, sign});
+        n_changes++;
+        s.ph.reset();
+        // a new fit (and curve) from the onset; the previous curve ends before it (by time: fits can be
+        // missing for some runs, e.g. before the regression was defined)
+        s.reg.keep_last(n_after);
+        curve& prev = s.curves.back();
+        while (!prev.empty() && prev.back().first >= noise_runs.trg_start[onset]) prev.pop_back();
+        s.curves.emplace_back();
+        for (int k = 0; k + 1 < s.reg.size(); k++) add_fit(s, s.reg.point(k).first);
+      }
+      add_fit(s, x);
     }
+    return n_changes;
+  }
+
+  const std::vector<int>& rows () const { return mRows; }
+  const std::vector<trend_changepoint>& changepoints () const { return mChanges; }
+  const std::vector<curve>& curves (int q) const { return mSeries[q].curves; }
+  const trend_config& config () const { return mCfg; }
+
+ private:
+  struct series
+  {
+    rolling_regression reg;
+    page_hinkley ph;
+    std::vector<curve> curves; // rolling fit at each run, one curve per segment between changes
+  };
+
+  void add_fit (series& s, double x)
+  {
+    double intercept, slope, chi2;
+    if (s.reg.fit(intercept, slope, chi2)) s.curves.back().push_back({x + mT0, intercept + slope * x});
+  }
+
+  trend_config mCfg;
+  long mT0 = 0;
+  std::vector<int> mRows;
+  std::vector<trend_changepoint> mChanges;
+  std::array<series, n_trend_quantities> mSeries;
+};
+
+// line of the fitted values of a curve (owned by the caller)
+TGraph* trend_fit_graph (const trend_monitor::curve& c, Color_t clr, Style_t lst)
+{
+  std::vector<double> x, y;
+  for (auto const& p : c) {
+    x.push_back(p.first);
+    y.push_back(p.second);
+  }
+  TGraph* g = new TGraph(x.size(), x.data(), y.data());
+  g->SetLineColor(clr);
+  g->SetLineStyle(lst);
+  g->SetLineWidth(2);
+  return g;
+}
+
+// trend of the selected runs (indices in noise_runs)
+// x_range: time axis shared by several trend plots (by default the range of this plot)
+// monitor: rolling fits and changepoints of the selected runs (by default computed here)
+void noisy_pix_trend (const noise_run_table& noise_runs, const std::vector<int>& selected, std::string plot_opt,
+  delay_window delays, std::tuple<float, float, float, float> force_ranges, std::string folder,
+  std::pair<double, double> x_range = {0, 0}, const trend_monitor* monitor = nullptr)
+{
+  plot_objects objs;
+  trend_monitor monitor_sel;
+  if (!monitor) {
+    std::vector<int> by_time = selected;
+    std::stable_sort(by_time.begin(), by_time.end(), [&] (int a, int b) { return noise_runs.trg_start[a] < noise_runs.trg_start[b]; });
+    for (int i : by_time) monitor_sel.add(noise_runs, i);
+    monitor = &monitor_sel;
   }
+  std::string fname = Form("%strend_ready(%.0f-%.0f)_sb(%.0f-%.0f)", 
+    folder.data(), std::get<2>(delays), std::get<3>(delays), std::get<0>(delays), std::get<1>(delays));
+
+  int n_sel = selected.size();
+  std::vector<int> run_numbers(n_sel);
+  std::vector<double> trg_start(n_sel), y_total(n_sel), y_new(n_sel), y_disapp(n_sel);
+  for (int j = 0; j < n_sel; j++) {
+    int i = selected[j];
+    run_numbers[j] = noise_runs.run[i];
+    trg_start[j] = noise_runs.trg_start[i];
+    y_total[j] = noise_runs.total[i];
+    y_new[j] = noise_runs.new_pixs[i];
+    y_disapp[j] = noise_runs.disapp[i];
+  }
+  TGraph* gr_trend_total = objs.add(new TGraph(n_sel, trg_start.data(), y_total.data()));
+  TGraph* gr_trend_new = objs.add(new TGraph(n_sel, trg_start.data(), y_new.data()));
+  TGraph* gr_trend_disapp = objs.add(new TGraph(n_sel, trg_start.data(), y_disapp.data()));
+
+  TF1 *f_total = objs.add(new TF1("f", "[1]*x + [0]"));
 
   // fits
   gr_trend_total->Fit(f_total);
@@ -210,19 +665,18 @@ void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
   float margin_b = 0.15;
   float margin_l = 0.12;
 
-  TCanvas* c = new TCanvas("", "", 900, 700);
+  TCanvas* c = objs.add(new TCanvas("", "", 900, 700));
   c->cd();
   // first pad
-  TPad* p1 = new TPad("", "", 0., 0., 1., 1.);
+  TPad* p1 = objs.add(new TPad("", "", 0., 0., 1., 1.));
   set_margins(p1, margin_t, margin_r, margin_b, margin_l);
   p1->Draw();
   p1->cd();
 
   // x-axis
-  if(first_execution) {
-    xmin = gr_trend_total->GetXaxis()->GetXmin();
-    xmax = gr_trend_total->GetXaxis()->GetXmax();
-  }
+  float xmin = gr_trend_total->GetXaxis()->GetXmin();
+  float xmax = gr_trend_total->GetXaxis()->GetXmax();
+  if (x_range.first < x_range.second) std::tie(xmin, xmax) = x_range;
   float dx = (xmax - xmin) / (1. - margin_l - margin_r);
   gr_trend_total->GetXaxis()->SetLabelSize(0);
   gr_trend_total->GetXaxis()->SetTitleSize(0);
@@ -257,22 +711,43 @@ void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
     gr_trend_total->GetPoint(i, x, y);
     if (x > x_curr + x_incr) {
       // label
-      t = new TLatex(x, ymin - dy * margin_b / 3, Form("%i", run_numbers[i]));
+      t = objs.add(new TLatex(x, ymin - dy * margin_b / 3, Form("%i", run_numbers[i])));
       t->SetTextSize(0.025);
       t->SetTextFont(42);
       t->SetTextAlign(22);
       t->SetTextAngle(90);
       t->Draw();
       // tick
-      TLine* l = new TLine(x, ymin, x, ymin + (ymax - ymin) * 0.015);
+      TLine* l = objs.add(new TLine(x, ymin, x, ymin + (ymax - ymin) * 0.015));
       l->Draw();
 
       x_curr = x;  
     }
   }
 
+  // rolling fits of the total, changepoints of all quantities
+  TGraph* gr_fit_total = nullptr;
+  for (auto const& curve : monitor->curves(trend_total)) {
+    if (curve.size() < 2) continue;
+    TGraph* gr = objs.add(trend_fit_graph(curve, kRed, 1));
+    gr->Draw("L");
+    if (!gr_fit_total) gr_fit_total = gr;
+  }
+  std::ofstream csv(fname + "_changes.csv");
+  csv << "run,trg_start,quantity,change\n";
+  for (auto const& cp : monitor->changepoints()) {
+    double x_cp = noise_runs.trg_start[cp.row];
+    TLine* l_cp = objs.add(new TLine(x_cp, ymin, x_cp, ymax));
+    l_cp->SetLineColor(cp.quantity == trend_total ? kRed : kMagenta+1);
+    l_cp->SetLineStyle(cp.quantity == trend_disapp ? 3 : 2);
+    l_cp->Draw();
+    csv << noise_runs.run[cp.row] << "," << noise_runs.trg_start[cp.row] << "," << trend_quantity_names[cp.quantity]
+        << "," << (cp.sign > 0 ? "increase" : "decrease") << "\n";
+  }
+  csv.close();
+
   // create the title
-  t = new TLatex(xmax + dx * margin_r / 2, ymin - dy * margin_b * 4/5, " Time (run numbers are shown)");
+  t = objs.add(new TLatex(xmax + dx * margin_r / 2, ymin - dy * margin_b * 4/5, " Time (run numbers are shown)"));
   t->SetTextSize(tsize);
   t->SetTextFont(42);
   t->SetTextAlign(32);
@@ -288,7 +763,7 @@ void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
   float dy2 = (ymax2 - ymin2) / (1. - margin_t - margin_b);
   
   // second pad
-  TPad* p2 = new TPad("", "", 0., 0., 1., 1.);
+  TPad* p2 = objs.add(new TPad("", "", 0., 0., 1., 1.));
   set_margins(p2, margin_t, margin_r, margin_b, margin_t);
   p2->Range(xmin-margin_l*dx, ymin2-margin_b*dy2, xmax+margin_r*dx, ymax2+margin_t*dy2);
   p2->SetFillStyle(4000); // transparent
@@ -297,8 +772,13 @@ void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
   gr_trend_new->GetYaxis()->SetTitle("#New/disappeared pixels");
   gr_trend_new->Draw(Form("%s", plot_opt.data()));
   gr_trend_disapp->Draw(Form("%s SAME", plot_opt.data()));
+  for (int q : {trend_new, trend_disapp}) {
+    for (auto const& curve : monitor->curves(q)) {
+      if (curve.size() > 1) objs.add(trend_fit_graph(curve, kMagenta+1, q == trend_new ? 1 : 2))->Draw("L");
+    }
+  }
   // right axis
-  TGaxis *ax = new TGaxis(xmax, ymin2, xmax, ymax2, ymin2, ymax2, 510, "+L");
+  TGaxis *ax = objs.add(new TGaxis(xmax, ymin2, xmax, ymax2, ymin2, ymax2, 510, "+L"));
   ax->SetTitle("#New/disappeared noisy pixels");
   ax->SetTitleOffset(1.5);
   ax->SetTitleFont(tfont);
@@ -310,49 +790,266 @@ void noisy_pix_trend (std::vector<noise>* noise_runs, std::string plot_opt,
   ax->SetLineColor(kBlue);
   ax->Draw();
   // legend
-  TLegend* l = new TLegend(0.15, 0.83, 0.45, 0.97);
+  TLegend* l = objs.add(new TLegend(0.15, 0.80, 0.45, 0.97));
   l->AddEntry(gr_trend_total, Form("total + fit: #it{f}(#it{x}) = %.2e + %.2e #it{x} ", 
     f_total->GetParameter(0), f_total->GetParameter(1)), plot_opt.data());
   l->AddEntry(gr_trend_new, "new", plot_opt.data());
   l->AddEntry(gr_trend_disapp, "disappeared", plot_opt.data());
+  if (gr_fit_total) l->AddEntry(gr_fit_total, Form("fits of %i runs, changepoints: %zu", monitor->config().n_window,
+    monitor->changepoints().size()), "L");
   l->AddEntry((TObject*)0, Form("#runs: %i", gr_trend_total->GetN()), "");
   l->SetBorderSize(0);
   l->SetFillStyle(0);
   l->SetTextSize(0.03);
   l->Draw();
-  c->Print(Form("%strend_ready(%.0f-%.0f)_sb(%.0f-%.0f).pdf", 
-    folder.data(), std::get<2>(delays), std::get<3>(delays), std::get<0>(delays), std::get<1>(delays)));
+  c->Print((fname + ".pdf").data());
+  return;
+}
 
-  first_execution = false;
+// time axis drawn for the selected runs (the range of the graph, including its margins)
+std::pair<double, double> trend_x_range (const noise_run_table& noise_runs, const std::vector<int>& selected)
+{
+  if (selected.empty()) return {0, 0};
+  std::vector<double> x, y(selected.size(), 0);
+  for (int i : selected) x.push_back(noise_runs.trg_start[i]);
+  TGraph gr(x.size(), x.data(), y.data());
+  return {gr.GetXaxis()->GetXmin(), gr.GetXaxis()->GetXmax()};
+}
+
+void noisy_pix_trend (const noise_run_table& noise_runs, std::string plot_opt,
+  delay_window delays = {0, 1e4, 0, 1e4}, // sb_min, sb_max, re_min, re_max
+  std::tuple<float, float, float, float> force_ranges = {-1, -1, -1, -1},
+  std::string folder = "")
+{
+  noisy_pix_trend(noise_runs, select_runs(noise_runs, {delays})[0], plot_opt, delays, force_ranges, folder);
   return;
 }
 
-void noisy_pixels_plots (long start_min, long start_max)
+// n cuts equally spaced in [min, max]
+std::vector<float> linear_cuts (float min, float max, int n)
 {
-  gStyle->SetOptStat(0);
-  std::vector<noise>* noise_runs = read_csv("input.csv", start_min, start_max);
+  std::vector<float> cuts(n);
+  for (int i = 0; i < n; i++) cuts[i] = n > 1 ? min + (max - min) * i / (n - 1) : min;
+  return cuts;
+}
+
+// slope of the fit of total noisy pixels vs. time (the f_total fit of noisy_pix_trend) for each cell of a grid
+// of delay cuts: runs with time since last SB stop in [0, sb_cut) and time since last GO_READY >= re_cut
+// the runs are binned once by the cut grid and the regression sums of every cell come from 2d cumulative sums,
+// so each cell costs O(1) instead of a fit
+void noisy_pix_cut_scan (const noise_run_table& noise_runs, std::vector<float> sb_cuts, std::vector<float> re_cuts, std::string folder = "")
+{
+  auto t_start = std::chrono::steady_clock::now();
+  std::sort(sb_cuts.begin(), sb_cuts.end());
+  std::sort(re_cuts.begin(), re_cuts.end());
+  int N_sb = sb_cuts.size();
+  int N_re = re_cuts.size();
+  if (!N_sb || !N_re || noise_runs.empty()) return;
+
+  // time relative to the first run, to keep the sums precise
+  long t0 = *std::min_element(noise_runs.trg_start.begin(), noise_runs.trg_start.end());
 
-  if(!noise_runs) {
-    std::cout << "Noise run vector could not be loaded\n";
+  // run (delay_sb, delay_re) -> bucket (ia, ib): included in the cells with i >= ia and j < ib
+  std::vector<regression_sums> grid((N_sb + 1) * (N_re + 1));
+  for (size_t k = 0; k < noise_runs.size(); k++) {
+    if (noise_runs.delay_sb[k] < 0) continue;
+    int ia = std::upper_bound(sb_cuts.begin(), sb_cuts.end(), noise_runs.delay_sb[k]) - sb_cuts.begin();
+    int ib = std::upper_bound(re_cuts.begin(), re_cuts.end(), noise_runs.delay_re[k]) - re_cuts.begin();
+    grid[ia * (N_re + 1) + ib].add(noise_runs.trg_start[k] - t0, noise_runs.total[k]);
+  }
+  // cumulative sums: ascending in ia, descending in ib
+  for (int ia = 0; ia <= N_sb; ia++) {
+    for (int ib = N_re; ib >= 0; ib--) {
+      regression_sums& cell = grid[ia * (N_re + 1) + ib];
+      if (ia > 0) cell.add(grid[(ia - 1) * (N_re + 1) + ib]);
+      if (ib < N_re) cell.add(grid[ia * (N_re + 1) + ib + 1]);
+      if (ia > 0 && ib < N_re) cell.subtract(grid[(ia - 1) * (N_re + 1) + ib + 1]);
+    }
+  }
+
+  // bin edges: the cuts, the last bin as wide as the previous one
+  std::vector<double> ax_sb(sb_cuts.begin(), sb_cuts.end()), ax_re(re_cuts.begin(), re_cuts.end());
+  ax_sb.push_back(N_sb > 1 ? 2 * ax_sb[N_sb-1] - ax_sb[N_sb-2] : ax_sb[0] + 1);
+  ax_re.push_back(N_re > 1 ? 2 * ax_re[N_re-1] - ax_re[N_re-2] : ax_re[0] + 1);
+  TH2D* h_slope = new TH2D("h_slope", "Slope of the fit [#noisy pixels / day]", N_sb, &ax_sb[0], N_re, &ax_re[0]);
+  TH2D* h_intercept = new TH2D("h_intercept", "Intercept of the fit", N_sb, &ax_sb[0], N_re, &ax_re[0]);
+  TH2D* h_chi2 = new TH2D("h_chi2", "#chi^{2}/NDF of the fit", N_sb, &ax_sb[0], N_re, &ax_re[0]);
+  TH2D* h_runs = new TH2D("h_runs", "#Runs", N_sb, &ax_sb[0], N_re, &ax_re[0]);
+  // not owned by gDirectory: scans of several periods in one process keep their own histograms
+  for (TH2D* h : {h_slope, h_intercept, h_chi2, h_runs}) h->SetDirectory(nullptr);
+
+  std::ofstream csv(Form("%scut_scan.csv", folder.data()));
+  csv << std::setprecision(10) << "sb_max,re_min,runs,intercept,slope,chi2\n";
+  int n_fits = 0;
+  for (int i = 0; i < N_sb; i++) {
+    for (int j = 0; j < N_re; j++) {
+      // cell (i, j) sums all buckets ia <= i and ib > j
+      const regression_sums& sums = grid[i * (N_re + 1) + j + 1];
+      double intercept, slope, chi2;
+      h_runs->SetBinContent(i+1, j+1, sums.n);
+      if (!sums.fit(intercept, slope, chi2)) continue;
+      intercept -= slope * t0; // back to unix time
+      n_fits++;
+      csv << sb_cuts[i] << "," << re_cuts[j] << "," << sums.n << "," << intercept << "," << slope << "," << chi2 << "\n";
+      h_slope->SetBinContent(i+1, j+1, slope * 86400);
+      h_intercept->SetBinContent(i+1, j+1, intercept);
+      if (sums.n > 2) h_chi2->SetBinContent(i+1, j+1, chi2 / (sums.n - 2));
+    }
+  }
+  csv.close();
+  double t_scan = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+  std::cout << "Cut scan: " << N_sb * N_re << " cut combinations (" << n_fits << " fits) in " << t_scan << " ms\n";
+
+  TFile* f = TFile::Open(Form("%scut_scan.root", folder.data()), "recreate");
+  h_slope->Write();
+  h_intercept->Write();
+  h_chi2->Write();
+  h_runs->Write();
+  f->Close();
+
+  TCanvas* c = new TCanvas("", "", 900, 700);
+  set_margins(c, 0.07, 0.15, 0.10, 0.12);
+  h_slope->GetXaxis()->SetTitle("Time since last SB stop < [min]");
+  h_slope->GetXaxis()->SetTitleSize(0.035);
+  h_slope->GetXaxis()->SetTitleOffset(1.2);
+  h_slope->GetYaxis()->SetTitle("Time since last GO_READY #geq [min]");
+  h_slope->GetYaxis()->SetTitleSize(0.035);
+  h_slope->GetYaxis()->SetTitleOffset(1.5);
+  h_slope->GetZaxis()->SetLabelSize(0.03);
+  h_slope->Draw("colz");
+  c->Print(Form("%scut_scan_slope.pdf", folder.data()));
+
+  TCanvas* c_chi2 = new TCanvas("", "", 900, 700);
+  set_margins(c_chi2, 0.07, 0.15, 0.10, 0.12);
+  h_chi2->GetXaxis()->SetTitle("Time since last SB stop < [min]");
+  h_chi2->GetXaxis()->SetTitleSize(0.035);
+  h_chi2->GetXaxis()->SetTitleOffset(1.2);
+  h_chi2->GetYaxis()->SetTitle("Time since last GO_READY #geq [min]");
+  h_chi2->GetYaxis()->SetTitleSize(0.035);
+  h_chi2->GetYaxis()->SetTitleOffset(1.5);
+  h_chi2->GetZaxis()->SetLabelSize(0.03);
+  h_chi2->Draw("colz");
+  c_chi2->Print(Form("%scut_scan_chi2.pdf", folder.data()));
+  return;
+}
+
+// delay windows of the trend plots
+// time since last SB stop: min, max [minutes]
+// time since last GO_READY: min, max [minutes]
+const std::vector<delay_window> trend_windows = {
+  {0, 1e5, 0, 1e4}, // all runs
+  {0, 30, 30, 1e4}, // "standard" noise runs only
+  {60, 1e5, 0, 30}, // group 2
+  {60, 1e5, 0, 5} // group 2 extreme
+};
+
+// all plot data of one report (correlations, run selections, shared time axis) is computed here,
+// the returned jobs only draw and print the canvases; noise_runs has to outlive the jobs
+std::vector<std::function<void()>> report_jobs (const noise_run_table& noise_runs, std::string folder,
+  const delay_binning& bins = delay_binning())
+{
+  std::vector<std::function<void()>> jobs;
+  if (true) {
+    std::shared_ptr<delay_correlation> corr(new delay_correlation(compute_delay_correlation(noise_runs, bins)));
+    jobs.push_back([corr, folder] () { draw_delay_correlation(*corr, folder); });
+  }
+  if (true) {
+    std::shared_ptr<std::vector<std::vector<int>>> selected(new std::vector<std::vector<int>>(select_runs(noise_runs, trend_windows)));
+    std::pair<double, double> x_range = trend_x_range(noise_runs, selected->front());
+    for (size_t w = 0; w < trend_windows.size(); w++) {
+      jobs.push_back([&noise_runs, selected, w, x_range, folder] () {
+        noisy_pix_trend(noise_runs, (*selected)[w], "LP", trend_windows[w], {5400, 10600, 0, 4200}, folder, x_range);
+      });
+    }
+  }
+  if (true) {
+    // slope of the trend for a grid of cuts: SB stop < 5..600 min, GO_READY >= 0..600 min
+    jobs.push_back([&noise_runs, folder] () {
+      noisy_pix_cut_scan(noise_runs, linear_cuts(5, 600, 120), linear_cuts(0, 600, 121), folder);
+    });
+  }
+  return jobs;
+}
+
+// runs the jobs in n_workers forked processes (job i in worker i % n_workers), each with its own copy
+// of the plot data and its own canvases; sequentially in this process if n_workers <= 1
+void render_parallel (const std::vector<std::function<void()>>& jobs, int n_workers)
+{
+  n_workers = std::min(n_workers, (int)jobs.size());
+  if (n_workers <= 1) {
+    for (auto const& job : jobs) job();
     return;
   }
+  std::cout << "Rendering " << jobs.size() << " plots in " << n_workers << " processes\n";
+  std::cout.flush();
+  std::vector<pid_t> workers;
+  for (int w = 0; w < n_workers; w++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (size_t i = w; i < jobs.size(); i += n_workers) jobs[i]();
+      std::cout.flush();
+      _exit(0);
+    }
+    if (pid < 0) {
+      // no more processes: this process takes the jobs of the worker
+      std::cout << "Cannot start worker " << w << ", its plots are drawn sequentially\n";
+      for (size_t i = w; i < jobs.size(); i += n_workers) jobs[i]();
+    } else {
+      workers.push_back(pid);
+    }
+  }
+  for (pid_t pid : workers) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cout << "Plot worker " << pid << " failed\n";
+    }
+  }
+  return;
+}
 
-  std::string folder = Form("%s_%s/",
-    timestamp_to_str(std::get<0>(noise_runs->front().timestamps), "%y.%m.%d").data(),
-    timestamp_to_str(std::get<0>(noise_runs->back().timestamps), "%y.%m.%d").data()
+// report folder: <out_dir>/<first>_<last date>/
+std::string report_folder (const noise_run_table& noise_runs, std::string out_dir)
+{
+  return Form("%s/%s_%s/", out_dir.data(),
+    timestamp_to_str(noise_runs.trg_start.front(), "%y.%m.%d").data(),
+    timestamp_to_str(noise_runs.trg_start.back(), "%y.%m.%d").data()
   );
+}
 
-  gSystem->Exec(Form("mkdir -p %s/", folder.data()));
+// input: csv with the noise runs, the plots go to <out_dir>/<first>_<last date>/
+// n_workers > 1: batch mode, the canvases are drawn by n_workers processes once all plot data is ready
+// monthly: also one report per calendar month (CET)
+void noisy_pixels_plots (long start_min, long start_max, std::string input = "input.csv", std::string out_dir = ".",
+  int n_workers = 1, bool monthly = false, std::string delay_bins = "")
+{
+  gStyle->SetOptStat(0);
+  delay_binning bins;
+  if (!parse_delay_binning(delay_bins, bins)) return;
+  noise_run_table noise_runs;
+  if(!read_noise_run_table(input, noise_runs, start_min, start_max) || noise_runs.empty()) {
+    std::cout << "Noise run table could not be loaded\n";
+    return;
+  }
 
-  if (true) noisy_pix_correlation_with_delays(noise_runs, folder);
-  if (true) {
-    // time since last SB stop: min, max [minutes]
-    // time since last GO_READY: min, max [minutes]
-    noisy_pix_trend(noise_runs, "LP", {0, 1e5, 0, 1e4}, {5400, 10600, 0, 4200}, folder); // all runs
-    noisy_pix_trend(noise_runs, "LP", {0, 30, 30, 1e4}, {5400, 10600, 0, 4200}, folder); // "standard" noise runs only
-    noisy_pix_trend(noise_runs, "LP", {60, 1e5, 0, 30}, {5400, 10600, 0, 4200}, folder); // group 2
-    noisy_pix_trend(noise_runs, "LP", {60, 1e5, 0, 5}, {5400, 10600, 0, 4200}, folder); // group 2 extreme
+  // the full period first, then the months
+  std::vector<noise_run_table> reports = {noise_runs};
+  if (monthly) {
+    std::map<int, std::vector<int>> months;
+    for (size_t i = 0; i < noise_runs.size(); i++) {
+      std::tm t = unix_to_cet(noise_runs.trg_start[i]);
+      months[12 * t.tm_year + t.tm_mon].push_back(i);
+    }
+    for (auto const& month : months) reports.push_back(noise_runs.subset(month.second));
   }
-  
+
+  if (n_workers > 1) gROOT->SetBatch(true);
+  std::vector<std::function<void()>> jobs;
+  for (auto const& report : reports) {
+    std::string folder = report_folder(report, out_dir);
+    gSystem->Exec(Form("mkdir -p %s", folder.data()));
+    std::vector<std::function<void()>> report_plots = report_jobs(report, folder, bins);
+    jobs.insert(jobs.end(), report_plots.begin(), report_plots.end());
+  }
+  render_parallel(jobs, n_workers);
   return;
-}
\ No newline at end of file
+}
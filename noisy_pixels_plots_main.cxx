@@ -0,0 +1,44 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Standalone executable (mft-noisy-plots) around the noisy_pixels_plots macro, same arguments in the same order:
+// mft-noisy-plots start_min start_max [input] [out_dir] [n_workers] [monthly] [delay_bins]
+
+// cpp headers
+#include <string>
+#include <iostream>
+#include <stdexcept>
+// root headers
+#include "TROOT.h"
+// custom headers
+#include "noisy_pixels_plots.cxx"
+
+int main (int argc, char** argv)
+{
+  if (argc < 3 || argc > 8) {
+    std::cout << "Usage: " << argv[0] << " start_min start_max [input] [out_dir] [n_workers] [monthly] [delay_bins]\n"
+              << "  start_min, start_max: UNIX timestamps [s], input: csv with the noise runs, out_dir: folder for the plots\n"
+              << "  monthly: 0 or 1, delay_bins: e.g. \"sb_1d=0,10,30,60,1e4;re_2d=0,60,600,1e5\"\n";
+    return 1;
+  }
+  // the canvases are only saved to files
+  gROOT->SetBatch(true);
+  try {
+    long start_min = std::stol(argv[1]);
+    long start_max = std::stol(argv[2]);
+    std::string input = argc > 3 ? argv[3] : "input.csv";
+    std::string out_dir = argc > 4 ? argv[4] : ".";
+    int n_workers = argc > 5 ? std::stoi(argv[5]) : 1;
+    bool monthly = argc > 6 ? std::stoi(argv[6]) != 0 : false;
+    std::string delay_bins = argc > 7 ? argv[7] : "";
+    noisy_pixels_plots(start_min, start_max, input, out_dir, n_workers, monthly, delay_bins);
+  } catch (const std::invalid_argument&) {
+    std::cout << "Invalid argument, see " << argv[0] << " without arguments\n";
+    return 1;
+  } catch (const std::exception& e) {
+    std::cout << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
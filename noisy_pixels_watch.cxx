@@ -0,0 +1,178 @@
+// MFT study of the number of noisy pixels
+// with respect to the last SB stop and last GO_READY
+// David Grund, 2024
+
+// Watch mode: polls a local CCDB directory (layout of local_ccdb.h, e.g. where the snapshots of new noise maps
+// are dropped) and processes every new noise map as soon as it appears: extraction, comparison with the previous
+// map, one new row in the stats csvs; then only the plots affected by new noise runs are redrawn
+
+// cpp headers
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+// root headers
+#include "TROOT.h"
+#include "TSystem.h"
+#include "TStyle.h"
+// custom headers
+#include "noisy_pixels_count.cxx"
+#include "noisy_pixels_plots.cxx"
+
+// plots of the watch mode, kept up to date run by run
+struct watch_plots
+{
+  std::string input; // csv with the noise runs and their delays (input of the plots)
+  long offset = 0; // of the rows of input not read yet
+  std::string folder;
+  noise_run_table runs;
+  std::set<int> known_runs;
+  std::unique_ptr<delay_correlation> corr;
+  std::vector<trend_monitor> trends; // one per trend window
+};
+
+// adds the rows appended to the input csv since the last call to the correlations and the trend monitors
+// and redraws them, together with the trends of the delay windows containing a new run
+void refresh_watch_plots (watch_plots& plots)
+{
+  std::vector<int> rows_new;
+  read_csv_stream(plots.input, [&](const noise& n) {
+    if (!plots.known_runs.insert(n.run).second) return;
+    plots.runs.push_back(n);
+    rows_new.push_back(plots.runs.size() - 1);
+  }, 0, 2e9, false, &plots.offset);
+  if (rows_new.empty()) return;
+
+  if (!plots.corr) plots.corr.reset(new delay_correlation(compute_delay_correlation(plots.runs)));
+  else for (int i : rows_new) plots.corr->add(plots.runs, i);
+  draw_delay_correlation(*plots.corr, plots.folder);
+
+  std::vector<std::vector<int>> selected = select_runs(plots.runs, trend_windows);
+  std::vector<std::vector<int>> selected_new = select_runs(plots.runs.subset(rows_new), trend_windows);
+  std::pair<double, double> x_range = trend_x_range(plots.runs, selected[0]);
+  plots.trends.resize(trend_windows.size());
+  for (size_t w = 0; w < trend_windows.size(); w++) {
+    if (selected_new[w].empty()) continue;
+    // the new runs of the window go to its trend monitor in time order
+    std::vector<int> rows;
+    for (int k : selected_new[w]) rows.push_back(rows_new[k]);
+    std::stable_sort(rows.begin(), rows.end(), [&] (int a, int b) { return plots.runs.trg_start[a] < plots.runs.trg_start[b]; });
+    trend_monitor& trend = plots.trends[w];
+    for (int i : rows) {
+      int n_changes = trend.add(plots.runs, i);
+      for (int c = trend.changepoints().size() - n_changes; c < (int)trend.changepoints().size(); c++) {
+        const trend_changepoint& cp = trend.changepoints()[c];
+        std::cout << "Trend change (window " << w << "): " << trend_quantity_names[cp.quantity]
+                  << (cp.sign > 0 ? " up" : " down") << " from run " << plots.runs.run[cp.row] << "\n";
+      }
+    }
+    noisy_pix_trend(plots.runs, selected[w], "LP", trend_windows[w], {5400, 10600, 0, 4200}, plots.folder, x_range, &trend);
+  }
+  std::cout << "Plots updated with " << rows_new.size() << " new noise runs\n";
+  return;
+}
+
+// run and validity of a listed object, from its own headers
+template <typename G>
+noise_map_info listed_noise_map_info (const local_ccdb& ccdb, const std::pair<long, long>& object)
+{
+  std::map<std::string, std::string> headers = ccdb.object_headers(G::ccdb_path, object.first, object.second);
+  return noise_map_info_from_headers<G>(headers, object.first);
+}
+
+// ccdb_dir: local CCDB directory to poll every poll_s seconds (max_polls < 0: forever)
+// the stats csvs, the cache and the index are the ones of noisy_pixels_count in the working directory,
+// the plots (from the noise runs in input) go to <out_dir>/watch/
+void noisy_pixels_watch (std::string ccdb_dir = "ccdb", std::string input = "input.csv", std::string out_dir = ".",
+  int poll_s = 10, long max_polls = -1, int n_threads = 4)
+{
+  typedef mft_geometry G;
+  gSystem->Exec(Form("mkdir -p %s", G::folder));
+  gROOT->SetBatch(true);
+  gStyle->SetOptStat(0);
+
+  local_ccdb ccdb;
+  ccdb.init(ccdb_dir);
+  validity_index index;
+  index.load(index_fname<G>());
+  basic_noise_map_history<noise_map> history;
+  bool history_ok = history.open(history_fname<G>());
+
+  // maps valid from after the last processed one are new and compared with the map processed before them;
+  // without a stats csv, the history is left to noisy_pixels_count: the newest indexed map (e.g. the reference
+  // of an earlier watch), or else the newest listed one, is the first reference
+  long last_from = last_processed_valid_from(stats_fname<G>(), index);
+  if (last_from < 0 && index.newest()) last_from = index.newest()->val_from;
+  if (last_from < 0) {
+    std::vector<std::pair<long, long>> objects = ccdb.list_objects(G::ccdb_path);
+    if (!objects.empty()) last_from = objects.back().first;
+  }
+  std::cout << "Watching " << ccdb_dir << " for noise maps valid from after " << last_from << "\n";
+
+  watch_plots plots;
+  plots.input = input;
+  plots.folder = out_dir + "/watch/";
+  gSystem->Exec(Form("mkdir -p %s", plots.folder.data()));
+  refresh_watch_plots(plots);
+
+  noise_map prev; // last processed map, the reference of the next one
+  noise_map_info info_prev;
+  for (long poll = 0; max_polls < 0 || poll < max_polls; poll++) {
+    if (poll) std::this_thread::sleep_for(std::chrono::seconds(poll_s));
+    std::vector<std::pair<long, long>> objects = ccdb.list_objects(G::ccdb_path);
+    for (size_t i = 0; i < objects.size(); i++) {
+      if (objects[i].first < last_from || (objects[i].first == last_from && prev.run >= 0)) continue;
+      // at start, the last processed map (or the first one listed) is only loaded as the reference
+      bool reference = prev.run < 0 && (objects[i].first == last_from || last_from < 0);
+      auto t_start = std::chrono::steady_clock::now();
+      timing.clear();
+      noise_map_info info_curr;
+      noise_map curr;
+      bool ok = true;
+      try {
+        info_curr = listed_noise_map_info<G>(ccdb, objects[i]);
+        ok = fetch_noise_map(ccdb, info_curr, curr, false);
+        if (ok && prev.run < 0 && !reference) {
+          // the last processed map is not listed any more: from the cache
+          const validity_entry* e = index.find(last_from);
+          ok = e && load_noise_map(e->run, prev);
+          if (ok) info_prev = {e->run, e->val_from, e->val_until, last_from, e->etag};
+        }
+        // validities from the listed headers: the previous map was cut short when this one arrived
+        if (ok && !reference && i > 0 && objects[i - 1].first == info_prev.val_from) {
+          noise_map_info info = listed_noise_map_info<G>(ccdb, objects[i - 1]);
+          index.add({info.val_from, info.val_until, info.run, info.etag});
+        }
+      } catch (const std::exception& e) {
+        std::cout << e.what() << "\n";
+        ok = false;
+      }
+      if (!ok) {
+        // retried at the next poll (e.g. a snapshot which is still being written)
+        std::cout << "Noise map valid from " << objects[i].first << " could not be processed\n";
+        break;
+      }
+      index.add({info_curr.val_from, info_curr.val_until, info_curr.run, info_curr.etag});
+      index.save(index_fname<G>());
+      last_from = objects[i].first;
+      if (!reference) {
+        std::vector<std::string> run_rows, chip_rows;
+        noise_step_stats(curr, prev, info_curr, n_threads, run_rows, chip_rows);
+        append_csv_rows(stats_fname<G>(), stats_header, run_rows);
+        append_csv_rows(chip_stats_fname<G>(), chip_stats_header, chip_rows);
+        if (history_ok) history_ok = history.append(curr, prev);
+      }
+      prev = std::move(curr);
+      info_prev = info_curr;
+      std::cout << "Noise map of run " << prev.run << (reference ? " loaded as the reference in " : " processed in ")
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count() << " s\n";
+    }
+    refresh_watch_plots(plots);
+  }
+  return;
+}
@@ -1,15 +1,67 @@
 # chmod +x run_noisy_pixels.sh
 #!/bin/bash
 
+# Usage: ./run_noisy_pixels.sh [step] [trg_start_min] [trg_start_max] [input] [output] [delay_bins]
+#   step: plots (default), report (plots per month too), count, validate (count, every extraction checked by
+#         the dense scan), update (append the new noise runs),
+#         its (count for ITS), watch (process new noise maps from a local CCDB as they arrive),
+#         chips (per-chip/disk trends from the cached maps), mask (pixels noisy in >= 80% of the cached runs), bench
+#   input: csv with the noise runs for the plots, output: folder for the outputs
+#   delay_bins: bin edges [min] of the delay correlations (plots, report), e.g. "sb_1d=0,10,30,60,1e4;re_2d=0,60,600,1e5"
+# The macros are compiled by ACLiC with optimization (+O): the first call builds <macro>_cxx.so,
+# the following ones load it directly as long as the sources did not change
+# Standalone executables with the same arguments (mft-noisy-count, mft-noisy-plots): see CMakeLists.txt
+
 # A few useful timestamps [CET]:
 # 1714514400 = 01/05/2024, 00:00:00
-# 1719784800 = 01/07/2024, 00:00:00 
+# 1719784800 = 01/07/2024, 00:00:00
 # 1725141600 = 01/09/2024, 00:00,00
-# 1730415600 = 01/11/2024, 00:00:00 
+# 1730415600 = 01/11/2024, 00:00:00
 
 # UNIX timestamp (type long, second precision -> 10 digits):
-trg_start_min=1714514400
-trg_start_max=1730415600
+step=${1:-plots}
+trg_start_min=${2:-1714514400}
+trg_start_max=${3:-1730415600}
+input=${4:-input.csv}
+output=${5:-.}
+delay_bins=${6:-}
+
+src=$(cd "$(dirname "$0")" && pwd)
+mkdir -p "$output"
+# the counting macros write to the working directory; CCDB timestamps have millisecond precision
+ts_first=${trg_start_min}000
+ts_last=${trg_start_max}000
 
-#root -q 'noisy_pixels_count.cxx+('$trg_start_min','$trg_start_max')'
-root -q 'noisy_pixels_plots.cxx('$trg_start_min','$trg_start_max')'
\ No newline at end of file
+case $step in
+  count)
+    cd "$output" && root -l -b -q "$src/noisy_pixels_count.cxx+O($ts_first,$ts_last)" ;;
+  validate)
+    # the same, but every map is downloaded again and its sparse extraction cross-checked by the dense scan on 8 threads
+    cd "$output" && root -l -b -q "$src/noisy_pixels_count.cxx+O($ts_first,$ts_last,false,\"http://alice-ccdb.cern.ch\",4,\"MFT\",8)" ;;
+  update)
+    # daily update: append the noise runs newer than the last one in input_noisy_pixs.csv (until now)
+    cd "$output" && root -l -b -q "$src/noisy_pixels_count.cxx+O(1714531157487,0,true)" ;;
+  its)
+    # the same for the ITS noise maps (input_noisy_pixs_its.csv, cache in noise_maps_its/)
+    cd "$output" && root -l -b -q "$src/noisy_pixels_count.cxx+O($ts_first,$ts_last,false,\"http://alice-ccdb.cern.ch\",4,\"ITS\")" ;;
+  watch)
+    # polls $output/ccdb every minute, plots of the noise runs in input updated in <output>/watch/
+    cd "$output" && root -l -b -q "$src/noisy_pixels_watch.cxx+O(\"ccdb\",\"$input\",\".\",60)" ;;
+  plots)
+    root -l -b -q "$src/noisy_pixels_plots.cxx+O($trg_start_min,$trg_start_max,\"$input\",\"$output\",1,false,\"$delay_bins\")" ;;
+  report)
+    # batch mode: the full period and one report per month, drawn by 8 processes
+    root -l -b -q "$src/noisy_pixels_plots.cxx+O($trg_start_min,$trg_start_max,\"$input\",\"$output\",8,true,\"$delay_bins\")" ;;
+  chips)
+    # runs x chips matrix from the cached maps (in the working directory of count), plots in <output>/chips/
+    cd "$output" && root -l -b -q "$src/noisy_pixels_chips.cxx+O(\"\",\".\")" ;;
+  mask)
+    # static mask from the cached maps of all runs: noisy in at least 80% of them, masks/ in the output folder
+    n_runs=$(ls "$output"/noise_maps/*.nmap 2>/dev/null | wc -l)
+    cd "$output" && root -l -b -q "$src/noisy_pixels_mask.cxx+O(0,999999,\"atleast\",$(( (n_runs * 4 + 4) / 5 )))" ;;
+  bench)
+    # synthetic noise maps and a local CCDB, results in <output>/bench/bench.json (dense scans and validation run included)
+    root -l -b -q "$src/noisy_pixels_bench.cxx+O(20000,20,0.1,5,\"$output/bench\",true,true)" ;;
+  *)
+    echo "Unknown step $step" ;;
+esac
@@ -2,6 +2,9 @@
 // with respect to the last SB stop and last GO_READY
 // David Grund, 2024
 
+#ifndef UTILITIES_H
+#define UTILITIES_H
+
 // cpp headers
 #include <iomanip>
 #include <iostream>
@@ -9,6 +12,30 @@
 #include <vector>
 #include <tuple>
 #include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <cmath>
+#include <charconv>
+#include <string_view>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <thread>
+// posix headers (memory-mapped noise map caches)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// root headers
+#include "TString.h"
 
 // structure to store noise run information
 struct noise
@@ -34,18 +61,148 @@ bool is_positive_int (const std::string& s)
   return !s.empty() && it == s.end();
 }
 
+// days since 01/01/1970 of a date in the (proleptic) Gregorian calendar
+long days_from_civil (int y, int m, int d)
+{
+  y -= m <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// inverse of days_from_civil
+void civil_from_days (long z, int& y, int& m, int& d)
+{
+  z += 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = yoe + era * 400 + (m <= 2);
+}
+
+// CET/CEST (the time zone of the csv dates and of the plots) independent of the time zone of the machine:
+// summer time from the last Sunday of March to the last Sunday of October (of September before 1996),
+// both at 01:00 UTC; no summer time before 1981
+struct cet_transitions
+{
+  static const int year_min = 1970;
+  static const int year_max = 2100;
+  long dst_start[year_max - year_min]; // unix timestamps (UTC)
+  long dst_end[year_max - year_min];
+
+  cet_transitions ()
+  {
+    for (int y = year_min; y < year_max; y++) {
+      if (y < 1981) {
+        dst_start[y - year_min] = dst_end[y - year_min] = 0;
+        continue;
+      }
+      dst_start[y - year_min] = last_sunday(y, 3) * 86400 + 3600;
+      dst_end[y - year_min] = last_sunday(y, y < 1996 ? 9 : 10) * 86400 + 3600;
+    }
+  }
+
+  // day (since 01/01/1970) of the last Sunday of the month
+  static long last_sunday (int y, int m)
+  {
+    long last_day = days_from_civil(m == 12 ? y + 1 : y, m == 12 ? 1 : m + 1, 1) - 1;
+    long weekday = (last_day + 4) % 7; // 01/01/1970 was a Thursday, Sunday = 0
+    return last_day - weekday;
+  }
+
+  // UTC offset [s] at a unix timestamp
+  long offset (long ts, int y) const
+  {
+    if (y < year_min || y >= year_max) return 3600;
+    return (ts >= dst_start[y - year_min] && ts < dst_end[y - year_min]) ? 7200 : 3600;
+  }
+};
+
+const cet_transitions& get_cet_transitions ()
+{
+  static const cet_transitions table; // computed once
+  return table;
+}
+
+// local CET/CEST time -> unix timestamp
+// (local times skipped in spring count as CET, repeated ones in autumn as CEST)
+long cet_to_unix (int y, int mo, int d, int h, int mi, int sec)
+{
+  long local = days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + sec;
+  return local - get_cet_transitions().offset(local - 7200, y);
+}
+
+// unix timestamp -> local CET/CEST time (as std::tm, without tm_isdst and tm_gmtoff)
+std::tm unix_to_cet (long ts)
+{
+  std::tm t = {};
+  int y, m, d;
+  civil_from_days((ts + 3600) / 86400 - ((ts + 3600) % 86400 < 0), y, m, d); // year of the CET date
+  long local = ts + get_cet_transitions().offset(ts, y);
+  long days = local / 86400 - (local % 86400 < 0);
+  long secs = local - days * 86400;
+  civil_from_days(days, y, m, d);
+  t.tm_year = y - 1900;
+  t.tm_mon = m - 1;
+  t.tm_mday = d;
+  t.tm_hour = secs / 3600;
+  t.tm_min = secs / 60 % 60;
+  t.tm_sec = secs % 60;
+  t.tm_wday = (days + 4) % 7;
+  if (t.tm_wday < 0) t.tm_wday += 7;
+  t.tm_yday = days - days_from_civil(y, 1, 1);
+  return t;
+}
+
+// parse "%d/%m/%Y, %H:%M:%S" (the layout of the csv dates) by direct digit arithmetic,
+// returns -1 if the string does not follow the layout
+long parse_cet_datestring (std::string_view s)
+{
+  int values[6];
+  const char separators[6] = {'/', '/', ',', ':', ':', 0};
+  size_t pos = 0;
+  for (int i = 0; i < 6; i++) {
+    if (i == 3) while (pos < s.size() && s[pos] == ' ') pos++; // spaces after the comma
+    int v = 0, n_digits = 0;
+    while (pos < s.size() && s[pos] >= '0' && s[pos] <= '9' && n_digits < 4) v = 10 * v + (s[pos++] - '0'), n_digits++;
+    if (!n_digits) return -1;
+    values[i] = v;
+    if (separators[i]) {
+      if (pos >= s.size() || s[pos] != separators[i]) return -1;
+      pos++;
+    }
+  }
+  if (pos != s.size()) return -1;
+  if (values[1] < 1 || values[1] > 12 || values[0] < 1 || values[0] > 31 || values[3] > 23 || values[4] > 59 || values[5] > 60) return -1;
+  return cet_to_unix(values[2], values[1], values[0], values[3], values[4], values[5]);
+}
+
 // convert date string with specified format to long (unix timestamp)
-long datestring_to_long (const std::string& s, std::string format, bool verbose = false)
+// the csv layout "%d/%m/%Y, %H:%M:%S" is read as CET/CEST, other formats in the local time zone
+long datestring_to_long (std::string_view s, std::string format, bool verbose = false)
 {
   long ts_long;
   if(s.length() < 2) { // empty string or end-of-line character
     ts_long = 0;
+  } else if (format == "%d/%m/%Y, %H:%M:%S") {
+    ts_long = parse_cet_datestring(s);
+    if (ts_long < 0) {
+      throw std::runtime_error(Form("Failed to convert %s to time", std::string(s).data()));
+    }
+    if(verbose) std::cout << s << " -> " << ts_long << "\n";
   } else {
-    std::tm t;
-    std::istringstream ss(s);
+    std::tm t = {};
+    t.tm_isdst = -1; // let mktime decide on daylight saving time
+    std::istringstream ss{std::string(s)};
     ss >> std::get_time(&t, format.data());
     if (ss.fail()) {
-      throw std::runtime_error(Form("Failed to convert %s to time", s.data()));
+      throw std::runtime_error(Form("Failed to convert %s to time", std::string(s).data()));
     }
     ts_long = (long)std::mktime(&t);
     if(verbose) std::cout << s << " -> " << ts_long << "\n";
@@ -53,87 +210,216 @@ long datestring_to_long (const std::string& s, std::string format, bool verbose
   return ts_long;
 }
 
-std::string timestamp_to_str (long ts, string format)
+// format a unix timestamp as CET/CEST time; %d, %m, %y, %Y, %H, %M, %S and %% are formatted directly,
+// any other conversion goes through std::strftime
+std::string timestamp_to_str (long ts, std::string format)
 {
-  std::time_t ts_as_time_t = ts; // convert from long to time_t
-  auto ts_as_tm = std::localtime(&ts_as_time_t);
-  char buff[80];
-  std::strftime(buff, sizeof(buff), format.data(), ts_as_tm);
-  std::string date(buff);
+  std::tm t = unix_to_cet(ts);
+  std::string date;
+  date.reserve(format.size() + 16);
+  auto append_2digits = [&](int v) { date += char('0' + v / 10 % 10); date += char('0' + v % 10); };
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '%' || i + 1 == format.size()) {
+      date += format[i];
+      continue;
+    }
+    switch (format[++i]) {
+      case 'd': append_2digits(t.tm_mday); break;
+      case 'm': append_2digits(t.tm_mon + 1); break;
+      case 'y': append_2digits((t.tm_year + 1900) % 100); break;
+      case 'Y': date += std::to_string(t.tm_year + 1900); break;
+      case 'H': append_2digits(t.tm_hour); break;
+      case 'M': append_2digits(t.tm_min); break;
+      case 'S': append_2digits(t.tm_sec); break;
+      case '%': date += '%'; break;
+      default: {
+        char buff[80];
+        std::strftime(buff, sizeof(buff), format.data(), &t);
+        return std::string(buff);
+      }
+    }
+  }
   return date;
 }
 
-std::vector<noise>* read_csv (string fname, long start_min = 0, long start_max = 2e9, bool verbose = false)
+// split a csv line into fields; a field may be surrounded by double quotes (then it can contain commas)
+// returns the number of fields found (at most max_fields)
+int split_csv_line (std::string_view line, std::string_view* fields, int max_fields)
 {
-  std::vector<noise>* runs = new std::vector<noise>;
-  std::vector<std::vector<std::string>> csv;
-  std::vector<std::string> row;
-  std::string line, item;
+  int n = 0;
+  size_t pos = 0;
+  while (pos <= line.size() && n < max_fields) {
+    if (pos < line.size() && line[pos] == '"') {
+      size_t end = line.find('"', pos + 1);
+      if (end == std::string_view::npos) end = line.size();
+      fields[n++] = line.substr(pos + 1, end - pos - 1);
+      pos = line.find(',', end);
+    } else {
+      size_t end = line.find(',', pos);
+      fields[n++] = line.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+      pos = end;
+    }
+    if (pos == std::string_view::npos) break;
+    pos++;
+  }
+  return n;
+}
 
-  // open and read the csv
-  fstream f(fname,ios::in);
-  if(f.is_open()) 
-  {
-		while(getline(f,line)) 
-    {
-		  row.clear();
-		  stringstream str(line);
-      // go until the first double quote
-      while(getline(str, item, '"')) 
-      {
-        // collect all items separated by commas
-        stringstream up_to_quote(item);
-        while(getline(up_to_quote, item, ',')) row.push_back(item);
-        // get the full surrounded by double quotes
-        if(getline(str, item, '"')) row.push_back(item);
-        // move behind the comma after the closing double quote
-        getline(str, item, ',');
-      }
-      csv.push_back(row);
-		}
-	} 
-  else 
-  {
+// non-negative integer made of digits only (as is_positive_int), -1 otherwise
+long parse_positive_int (std::string_view s)
+{
+  long value = -1;
+  if (s.empty()) return -1;
+  auto res = std::from_chars(s.data(), s.data() + s.size(), value);
+  if (res.ec != std::errc() || res.ptr != s.data() + s.size() || s[0] == '-' || s[0] == '+') return -1;
+  return value;
+}
+
+// parse one data line of the csv: run, total, new, disapp, trg_start, last_sb_stop, last_go_ready
+// returns false for lines that do not describe a noise run with noisy pixels
+bool parse_noise_line (std::string_view line, noise& n, bool verbose = false)
+{
+  if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+  std::string_view fields[7];
+  int n_fields = split_csv_line(line, fields, 7);
+  if (verbose) {
+    for (int j = 0; j < n_fields; j++) std::cout << fields[j] << "\t";
+    std::cout << "\n";
+  }
+  if (n_fields < 4) return false;
+  // run number and noisy_pixels (tuple) need to be positive integers
+  long values[4];
+  for (int j = 0; j < 4; j++) if ((values[j] = parse_positive_int(fields[j])) < 0) return false;
+  // #total noisy pixels > 0
+  if (values[1] <= 0) return false;
+  long ts[3];
+  for (int j = 0; j < 3; j++) {
+    ts[j] = (4 + j < n_fields) ? datestring_to_long(fields[4 + j], "%d/%m/%Y, %H:%M:%S") : 0;
+  }
+  n = noise(values[0], {values[1], values[2], values[3]}, {ts[0], ts[1], ts[2]});
+  return true;
+}
+
+// streaming csv reader: the file is read in fixed-size chunks and every noise run with
+// trg_start in (start_min, start_max) is passed to process(const noise&); the table is never held in memory
+// returns the number of noise runs passed, -1 if the file cannot be opened
+// offset (to follow a growing csv): reading starts at *offset (the header is only skipped at 0, a csv shorter
+// than *offset is read from the start), and *offset is left after the last complete line
+template<typename F>
+long read_csv_stream (std::string fname, F process, long start_min = 0, long start_max = 2e9, bool verbose = false,
+  long* offset = nullptr)
+{
+  FILE* f = std::fopen(fname.data(), "rb");
+  if (!f) {
     std::cout << "Cannot open " << fname << "\n";
+    return -1;
+  }
+  long n_done = 0; // position of the first byte not processed yet
+  if (offset && *offset > 0 && std::fseek(f, 0, SEEK_END) == 0 && std::ftell(f) >= *offset) n_done = *offset;
+  std::fseek(f, n_done, SEEK_SET);
+  const size_t chunk_size = 1 << 16;
+  std::vector<char> buff(chunk_size);
+  size_t n_carry = 0; // bytes of an incomplete line kept from the previous chunk
+  long n_runs = 0;
+  bool header = n_done == 0;
+  noise n(0, {0, 0, 0}, {0, 0, 0});
+  auto process_line = [&](std::string_view line) {
+    if (header) { // skip the first line
+      header = false;
+      return;
+    }
+    if (parse_noise_line(line, n, verbose) 
+      && (std::get<0>(n.timestamps) > start_min) && (std::get<0>(n.timestamps) < start_max)) {
+      process(n);
+      n_runs++;
+    }
+  };
+  while (true) {
+    if (n_carry == buff.size()) buff.resize(2 * buff.size()); // line longer than the buffer
+    size_t n_read = std::fread(buff.data() + n_carry, 1, buff.size() - n_carry, f);
+    size_t n_data = n_carry + n_read;
+    std::string_view data(buff.data(), n_data);
+    size_t line_start = 0;
+    for (size_t eol = data.find('\n'); eol != std::string_view::npos; eol = data.find('\n', line_start)) {
+      process_line(data.substr(line_start, eol - line_start));
+      line_start = eol + 1;
+    }
+    n_carry = n_data - line_start;
+    n_done += line_start;
+    std::memmove(buff.data(), buff.data() + line_start, n_carry);
+    if (n_read == 0) break;
+  }
+  // last line without end-of-line; when following the csv, it may still be being written
+  if (offset) *offset = n_done;
+  else if (n_carry) process_line(std::string_view(buff.data(), n_carry));
+  std::fclose(f);
+  return n_runs;
+}
+
+std::vector<noise>* read_csv (std::string fname, long start_min = 0, long start_max = 2e9, bool verbose = false)
+{
+  std::vector<noise>* runs = new std::vector<noise>;
+  long n_runs = read_csv_stream(fname, [&](const noise& n) { runs->push_back(n); }, start_min, start_max, verbose);
+  if (n_runs < 0) {
+    delete runs;
     return NULL;
   }
-  // print the loaded values?
-  if(verbose) 
+  std::cout << "CSV read successfully\n"
+    << " #noise runs: " << runs->size() << "\n";
+  return runs; 
+}
+
+// noise runs stored column-wise (one contiguous array per quantity)
+struct noise_run_table
+{
+  std::vector<int> run;
+  std::vector<int> total, new_pixs, disapp; // noisy pixels
+  std::vector<long> trg_start, last_sb_stop, last_go_ready; // unix timestamps
+  std::vector<float> delay_sb, delay_re; // time since the last SB stop and GO_READY [min]
+
+  size_t size () const { return run.size(); }
+  bool empty () const { return run.empty(); }
+
+  void push_back (const noise& n)
   {
-    for(int i = 0; i < (int)csv.size(); i++) {
-      for(int j = 0; j < (int)csv[i].size(); j++) std::cout << csv[i][j] << "\t";
-      std::cout << "\n";
-    }
+    run.push_back(n.run);
+    total.push_back(std::get<0>(n.noisy_pixels));
+    new_pixs.push_back(std::get<1>(n.noisy_pixels));
+    disapp.push_back(std::get<2>(n.noisy_pixels));
+    trg_start.push_back(std::get<0>(n.timestamps));
+    last_sb_stop.push_back(std::get<1>(n.timestamps));
+    last_go_ready.push_back(std::get<2>(n.timestamps));
+    delay_sb.push_back((std::get<0>(n.timestamps) - std::get<1>(n.timestamps)) / 60);
+    delay_re.push_back((std::get<0>(n.timestamps) - std::get<2>(n.timestamps)) / 60);
   }
-  // fill the vector of structures
-  for(int i = 1; i < (int)csv.size(); i++) 
+
+  // table of the given rows
+  noise_run_table subset (const std::vector<int>& rows) const
   {
-    // run number and noisy_pixels (tuple) need to be positive integers
-    bool positive_int = true;
-    for (int j = 0; j < 4; j++) if (!is_positive_int(csv[i][j])) positive_int = false;
-    if (positive_int) 
-    {
-      // #total noisy pixels > 0
-      if (std::stoi(csv[i][1]) > 0) 
-      {
-        std::tuple<int, int, int> noisy_pixels = {
-          std::stoi(csv[i][1]), std::stoi(csv[i][2]), std::stoi(csv[i][3])
-        };
-        std::tuple<long, long, long> timestamps = {
-          datestring_to_long(csv[i][4], "%d/%m/%Y, %H:%M:%S"), 
-          datestring_to_long(csv[i][5], "%d/%m/%Y, %H:%M:%S"),
-          datestring_to_long(csv[i][6], "%d/%m/%Y, %H:%M:%S")
-        };
-        noise run(std::stoi(csv[i][0]), noisy_pixels, timestamps);
-        if ((std::get<0>(timestamps) > start_min) && (std::get<0>(timestamps) < start_max)) {
-          runs->push_back(run);
-        }
-      }
+    noise_run_table t;
+    for (int i : rows) {
+      t.run.push_back(run[i]);
+      t.total.push_back(total[i]);
+      t.new_pixs.push_back(new_pixs[i]);
+      t.disapp.push_back(disapp[i]);
+      t.trg_start.push_back(trg_start[i]);
+      t.last_sb_stop.push_back(last_sb_stop[i]);
+      t.last_go_ready.push_back(last_go_ready[i]);
+      t.delay_sb.push_back(delay_sb[i]);
+      t.delay_re.push_back(delay_re[i]);
     }
+    return t;
   }
+};
+
+bool read_noise_run_table (std::string fname, noise_run_table& runs, long start_min = 0, long start_max = 2e9, bool verbose = false)
+{
+  runs = noise_run_table();
+  long n_runs = read_csv_stream(fname, [&](const noise& n) { runs.push_back(n); }, start_min, start_max, verbose);
+  if (n_runs < 0) return false;
   std::cout << "CSV read successfully\n"
-    << " #noise runs: " << runs->size() << "\n";
-  return runs; 
+    << " #noise runs: " << runs.size() << "\n";
+  return true;
 }
 
 template<typename T>
@@ -144,4 +430,1179 @@ void set_margins (T* c, float t, float r, float b, float l)
   c->SetBottomMargin(b);
   c->SetLeftMargin(l);
   return;
-}
\ No newline at end of file
+}
+
+// detector geometry, chosen at compile time: number of chips and pixels (ALPIDE: 512 rows x 1024 cols),
+// the pixel key type, the CCDB path of the noise map and where the caches and outputs go
+struct mft_geometry
+{
+  static constexpr const char* name = "MFT";
+  static constexpr int n_chips = 936;
+  static constexpr int n_rows = 512;
+  static constexpr int n_cols = 1024;
+  typedef uint32_t key_type; // 10-bit chipID
+  static constexpr const char* ccdb_path = "MFT/Calib/NoiseMap/";
+  static constexpr const char* folder = "noise_maps/";
+  static constexpr const char* suffix = ""; // of the output csvs
+};
+
+struct its_geometry
+{
+  static constexpr const char* name = "ITS";
+  static constexpr int n_chips = 24120;
+  static constexpr int n_rows = 512;
+  static constexpr int n_cols = 1024;
+  typedef uint64_t key_type; // 15-bit chipID does not fit 32 bits
+  static constexpr const char* ccdb_path = "ITS/Calib/NoiseMap/";
+  static constexpr const char* folder = "noise_maps_its/";
+  static constexpr const char* suffix = "_its";
+};
+
+// MFT geometry (used by the plots)
+const int N_chips = mft_geometry::n_chips;
+const int N_rows = mft_geometry::n_rows;
+const int N_cols = mft_geometry::n_cols;
+
+// packed pixel key: chipID, 9-bit row, 10-bit col
+// (ordering of the keys = ordering by chipID, row and col)
+template <typename Key = uint32_t>
+Key pixel_key (int chip, int row, int col)
+{
+  return ((Key)chip << 19) | ((Key)row << 10) | (Key)col;
+}
+template <typename Key> int key_chip (Key key) { return key >> 19; }
+template <typename Key> int key_row (Key key) { return (key >> 10) & 0x1ff; }
+template <typename Key> int key_col (Key key) { return key & 0x3ff; }
+
+constexpr int n_bits (long n) { return n > 1 ? 1 + n_bits((n + 1) / 2) : 0; }
+
+// noisy pixels of one noise map: sorted packed keys and their noise levels
+template <typename G>
+struct basic_noise_map
+{
+  typedef G geometry;
+  typedef typename G::key_type key_type;
+  static_assert(n_bits(G::n_rows) <= 9 && n_bits(G::n_cols) <= 10, "pixel does not fit the key");
+  static_assert(n_bits(G::n_chips) + 19 <= 8 * (int)sizeof(key_type), "chipID does not fit the key");
+
+  int run = -1;
+  std::vector<key_type> keys;
+  std::vector<int> noise;
+  size_t size() const { return keys.size(); }
+  void add(int chip, int row, int col, int n) { keys.push_back(pixel_key<key_type>(chip, row, col)); noise.push_back(n); }
+  bool operator==(const basic_noise_map& other) const { return keys == other.keys && noise == other.noise; }
+  bool operator!=(const basic_noise_map& other) const { return !(*this == other); }
+};
+
+typedef basic_noise_map<mft_geometry> noise_map;
+typedef basic_noise_map<its_geometry> its_noise_map;
+
+// cache file format (<folder>/<run>.nmap), native byte order:
+// header, keys[n_pixels] (version 1: uint32, version 2: uint64), int32 noise[n_pixels]
+struct noise_map_header
+{
+  char magic[4] = {'N', 'M', 'A', 'P'};
+  uint32_t version = 1;
+  int32_t run = -1;
+  uint32_t n_pixels = 0;
+};
+
+template <typename Key>
+constexpr uint32_t noise_map_version () { return sizeof(Key) == 4 ? 1 : 2; }
+
+std::string noise_map_fname (int run, std::string folder = "noise_maps/")
+{
+  return folder + std::to_string(run) + ".nmap";
+}
+
+template <typename Key = uint32_t>
+bool is_valid_noise_map_header (const noise_map_header& h)
+{
+  return h.magic[0] == 'N' && h.magic[1] == 'M' && h.magic[2] == 'A' && h.magic[3] == 'P' 
+    && h.version == noise_map_version<Key>();
+}
+
+// write the map to a temporary file first, so an interrupted job never leaves a truncated cache
+template <typename G>
+bool write_noise_map (const basic_noise_map<G>& m, std::string fname)
+{
+  typedef typename G::key_type key_type;
+  noise_map_header h;
+  h.version = noise_map_version<key_type>();
+  h.run = m.run;
+  h.n_pixels = m.size();
+  std::string fname_tmp = fname + ".tmp";
+  FILE* f = std::fopen(fname_tmp.data(), "wb");
+  if (!f) {
+    std::cout << "Cannot open " << fname_tmp << "\n";
+    return false;
+  }
+  bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+  if (h.n_pixels) {
+    ok = ok && std::fwrite(m.keys.data(), sizeof(key_type), h.n_pixels, f) == h.n_pixels;
+    ok = ok && std::fwrite(m.noise.data(), sizeof(int32_t), h.n_pixels, f) == h.n_pixels;
+  }
+  ok = (std::fclose(f) == 0) && ok;
+  ok = ok && std::rename(fname_tmp.data(), fname.data()) == 0;
+  if (!ok) {
+    std::cout << "Cannot write " << fname << "\n";
+    std::remove(fname_tmp.data());
+  }
+  return ok;
+}
+
+template <typename G>
+bool read_noise_map (std::string fname, basic_noise_map<G>& m)
+{
+  typedef typename G::key_type key_type;
+  FILE* f = std::fopen(fname.data(), "rb");
+  if (!f) {
+    std::cout << "Cannot open " << fname << "\n";
+    return false;
+  }
+  noise_map_header h;
+  bool ok = std::fread(&h, sizeof(h), 1, f) == 1 && is_valid_noise_map_header<key_type>(h);
+  if (ok) {
+    m.run = h.run;
+    m.keys.resize(h.n_pixels);
+    m.noise.resize(h.n_pixels);
+    if (h.n_pixels) {
+      ok = std::fread(m.keys.data(), sizeof(key_type), h.n_pixels, f) == h.n_pixels;
+      ok = ok && std::fread(m.noise.data(), sizeof(int32_t), h.n_pixels, f) == h.n_pixels;
+    }
+  }
+  std::fclose(f);
+  if (!ok) std::cout << "Corrupted noise map file " << fname << "\n";
+  return ok;
+}
+
+// size of the cache file of a map
+template <typename G>
+long noise_map_bytes (const basic_noise_map<G>& m)
+{
+  return sizeof(noise_map_header) + m.size() * (sizeof(typename G::key_type) + sizeof(int32_t));
+}
+
+// run numbers of all noise maps cached in the folder (<run>.nmap), in increasing order
+std::vector<int> list_cached_runs (std::string folder = "noise_maps/")
+{
+  std::vector<int> runs;
+  DIR* dir = opendir(folder.data());
+  if (!dir) {
+    std::cout << "Cannot open " << folder << "\n";
+    return runs;
+  }
+  while (dirent* entry = readdir(dir)) {
+    int run;
+    char ext[8];
+    if (std::sscanf(entry->d_name, "%d.%7s", &run, ext) == 2 && std::string(ext) == "nmap") runs.push_back(run);
+  }
+  closedir(dir);
+  std::sort(runs.begin(), runs.end());
+  return runs;
+}
+
+// read-only, memory-mapped view of a cached noise map (no copy of the pixel arrays)
+template <typename Key>
+class basic_noise_map_view
+{
+ public:
+  basic_noise_map_view () = default;
+  basic_noise_map_view (std::string fname) { open(fname); }
+  ~basic_noise_map_view () { close(); }
+  basic_noise_map_view (const basic_noise_map_view&) = delete;
+  basic_noise_map_view& operator= (const basic_noise_map_view&) = delete;
+
+  bool open (std::string fname)
+  {
+    close();
+    int fd = ::open(fname.data(), O_RDONLY);
+    if (fd < 0) {
+      std::cout << "Cannot open " << fname << "\n";
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(noise_map_header)) {
+      void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        mAddr = addr;
+        mLength = st.st_size;
+      }
+    }
+    ::close(fd);
+    const noise_map_header* h = (const noise_map_header*)mAddr;
+    if (!h || !is_valid_noise_map_header<Key>(*h) 
+      || mLength != sizeof(noise_map_header) + (size_t)h->n_pixels * (sizeof(Key) + sizeof(int32_t)))
+    {
+      std::cout << "Corrupted noise map file " << fname << "\n";
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close ()
+  {
+    if (mAddr) munmap(mAddr, mLength);
+    mAddr = nullptr;
+    mLength = 0;
+  }
+
+  bool is_open () const { return mAddr != nullptr; }
+  int run () const { return header()->run; }
+  size_t size () const { return header()->n_pixels; }
+  const Key* keys () const { return (const Key*)(header() + 1); }
+  const int32_t* noise () const { return (const int32_t*)(keys() + size()); }
+
+ private:
+  const noise_map_header* header () const { return (const noise_map_header*)mAddr; }
+  void* mAddr = nullptr;
+  size_t mLength = 0;
+};
+
+typedef basic_noise_map_view<uint32_t> noise_map_view;
+
+// bounded LRU cache of decoded noise maps, keyed by run number (thread-safe)
+// the maps are shared with the callers, so an evicted map stays valid as long as it is used
+template <typename M>
+class basic_noise_map_cache
+{
+ public:
+  typedef M noise_map;
+  basic_noise_map_cache (size_t capacity = 8) : mCapacity(capacity > 0 ? capacity : 1) {}
+
+  // nullptr if the map is not cached
+  std::shared_ptr<const noise_map> get (int run)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(run);
+    if (it == mIndex.end()) {
+      mMisses++;
+      return nullptr;
+    }
+    mHits++;
+    mItems.splice(mItems.begin(), mItems, it->second); // most recently used first
+    return it->second->second;
+  }
+
+  void put (std::shared_ptr<const noise_map> m)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(m->run);
+    if (it != mIndex.end()) mItems.erase(it->second);
+    mItems.emplace_front(m->run, std::move(m));
+    mIndex[mItems.front().first] = mItems.begin();
+    while (mItems.size() > mCapacity) {
+      mIndex.erase(mItems.back().first);
+      mItems.pop_back();
+    }
+  }
+
+  // on a miss, the map is decoded by load(run, map) and cached; nullptr if that fails
+  std::shared_ptr<const noise_map> get_or_load (int run, std::function<bool(int, noise_map&)> load)
+  {
+    std::shared_ptr<const noise_map> m = get(run);
+    if (m) return m;
+    std::shared_ptr<noise_map> loaded(new noise_map);
+    if (!load(run, *loaded)) return nullptr;
+    loaded->run = run;
+    put(loaded);
+    return loaded;
+  }
+
+  size_t size () { std::lock_guard<std::mutex> lock(mMutex); return mItems.size(); }
+  long hits () { std::lock_guard<std::mutex> lock(mMutex); return mHits; }
+  long misses () { std::lock_guard<std::mutex> lock(mMutex); return mMisses; }
+  // (hits, misses), read together
+  std::pair<long, long> hit_stats () { std::lock_guard<std::mutex> lock(mMutex); return {mHits, mMisses}; }
+
+ private:
+  size_t mCapacity;
+  typedef std::list<std::pair<int, std::shared_ptr<const noise_map>>> item_list;
+  item_list mItems;
+  std::unordered_map<int, typename item_list::iterator> mIndex;
+  std::mutex mMutex;
+  long mHits = 0;
+  long mMisses = 0;
+};
+
+typedef basic_noise_map_cache<noise_map> noise_map_cache;
+
+// validity interval of a noise map object in the CCDB
+struct validity_entry
+{
+  long val_from;
+  long val_until;
+  int run;
+  std::string etag;
+};
+
+// local index of the CCDB validity intervals already looked up (noise_maps/index.csv)
+// if intervals overlap, the one with the latest Valid-From wins, as in the CCDB
+class validity_index
+{
+ public:
+  bool load (std::string fname)
+  {
+    mEntries.clear();
+    std::ifstream f(fname);
+    if (!f.is_open()) return false;
+    std::string line;
+    std::getline(f, line); // header
+    while (std::getline(f, line)) {
+      validity_entry e;
+      char etag[256] = "";
+      if (std::sscanf(line.data(), "%ld,%ld,%d,%255[^\n]", &e.val_from, &e.val_until, &e.run, etag) < 3) continue;
+      e.etag = etag;
+      mEntries.push_back(e);
+    }
+    std::sort(mEntries.begin(), mEntries.end(), 
+      [](auto const& lhs, auto const& rhs) { return lhs.val_from < rhs.val_from; });
+    update_max_until();
+    return true;
+  }
+
+  bool save (std::string fname) const
+  {
+    std::string fname_tmp = fname + ".tmp";
+    std::ofstream f(fname_tmp);
+    if (!f.is_open()) {
+      std::cout << "Cannot open " << fname_tmp << "\n";
+      return false;
+    }
+    f << "valid_from,valid_until,run,etag\n";
+    for (auto const& e : mEntries) f << e.val_from << "," << e.val_until << "," << e.run << "," << e.etag << "\n";
+    f.close();
+    return std::rename(fname_tmp.data(), fname.data()) == 0;
+  }
+
+  // nullptr if no known interval contains ts
+  const validity_entry* find (long ts) const
+  {
+    // last entry starting at or before ts, then back while an earlier entry may still contain ts
+    int i = std::upper_bound(mEntries.begin(), mEntries.end(), ts, 
+      [](long t, auto const& e) { return t < e.val_from; }) - mEntries.begin() - 1;
+    for (; i >= 0 && mMaxUntil[i] >= ts; i--) {
+      if (mEntries[i].val_until >= ts) return &mEntries[i];
+    }
+    return nullptr;
+  }
+
+  // the Valid-Until of the newest map is open-ended and cut short when the next map is uploaded:
+  // an interval is only final if it ends before the newest indexed Valid-From
+  bool is_final (const validity_entry& e) const
+  {
+    return !mEntries.empty() && e.val_until < mEntries.back().val_from;
+  }
+
+  // an entry with the same Valid-From is replaced (e.g. by its updated Valid-Until)
+  void add (const validity_entry& e)
+  {
+    auto it = std::find_if(mEntries.begin(), mEntries.end(), 
+      [&](auto const& other) { return other.val_from == e.val_from; });
+    if (it != mEntries.end()) {
+      *it = e;
+      update_max_until();
+      return;
+    }
+    mEntries.insert(std::upper_bound(mEntries.begin(), mEntries.end(), e.val_from, 
+      [](long t, auto const& other) { return t < other.val_from; }), e);
+    update_max_until();
+  }
+
+  // latest interval of a run, nullptr if the run is not indexed
+  const validity_entry* find_run (int run) const
+  {
+    for (auto it = mEntries.rbegin(); it != mEntries.rend(); it++) if (it->run == run) return &(*it);
+    return nullptr;
+  }
+
+  // interval with the latest Valid-From, nullptr if the index is empty
+  const validity_entry* newest () const { return mEntries.empty() ? nullptr : &mEntries.back(); }
+
+  size_t size () const { return mEntries.size(); }
+
+ private:
+  void update_max_until ()
+  {
+    mMaxUntil.resize(mEntries.size());
+    for (size_t i = 0; i < mEntries.size(); i++) {
+      mMaxUntil[i] = i ? std::max(mMaxUntil[i-1], mEntries[i].val_until) : mEntries[i].val_until;
+    }
+  }
+
+  std::vector<validity_entry> mEntries; // sorted by val_from
+  std::vector<long> mMaxUntil; // running maximum of val_until
+};
+
+// result of the comparison of two noise maps
+struct noise_map_diff
+{
+  int total = 0; // noisy pixels in the current map
+  int new_pixs = 0; // noisy in the current map only
+  int disapp = 0; // noisy in the previous map only
+  std::vector<int> chip_total, chip_new, chip_disapp; // the same per chipID
+  noise_map_diff (int n_chips = N_chips) : chip_total(n_chips, 0), chip_new(n_chips, 0), chip_disapp(n_chips, 0) {}
+};
+
+// one-pass merge of two sorted key arrays
+template <typename Key>
+noise_map_diff diff_noise_maps (const Key* keys_curr, size_t n_curr, const Key* keys_prev, size_t n_prev, 
+  int n_chips = N_chips)
+{
+  noise_map_diff diff(n_chips);
+  size_t i_curr = 0, i_prev = 0;
+  while (i_curr < n_curr || i_prev < n_prev)
+  {
+    if (i_prev == n_prev || (i_curr < n_curr && keys_curr[i_curr] < keys_prev[i_prev])) {
+      // only in the current map
+      int chip = key_chip(keys_curr[i_curr++]);
+      diff.new_pixs++;
+      diff.chip_new[chip]++;
+      diff.chip_total[chip]++;
+    } else if (i_curr == n_curr || keys_prev[i_prev] < keys_curr[i_curr]) {
+      // only in the previous map
+      int chip = key_chip(keys_prev[i_prev++]);
+      diff.disapp++;
+      diff.chip_disapp[chip]++;
+    } else {
+      // common pixel
+      diff.chip_total[key_chip(keys_curr[i_curr])]++;
+      i_curr++;
+      i_prev++;
+    }
+  }
+  diff.total = n_curr;
+  return diff;
+}
+
+template <typename G>
+noise_map_diff diff_noise_maps (const basic_noise_map<G>& curr, const basic_noise_map<G>& prev)
+{
+  return diff_noise_maps(curr.keys.data(), curr.size(), prev.keys.data(), prev.size(), G::n_chips);
+}
+
+// k-way merge of sorted key lists (one per noise map) through a binary min-heap of the list heads:
+// f(key, n_lists, noise_sum) is called once per distinct key, in increasing order, with the number of lists
+// containing it and the sum of its noise levels; O(total keys * log n_lists) time, O(n_lists) memory
+template <typename Key, typename F>
+void merge_noise_maps (const std::vector<const Key*>& keys, const std::vector<const int32_t*>& noise,
+  const std::vector<size_t>& sizes, F f)
+{
+  struct head
+  {
+    Key key;
+    int list;
+  };
+  std::vector<head> heap;
+  std::vector<size_t> pos(keys.size(), 0);
+  for (size_t l = 0; l < keys.size(); l++) if (sizes[l]) heap.push_back({keys[l][0], (int)l});
+  std::make_heap(heap.begin(), heap.end(), [] (const head& a, const head& b) { return a.key > b.key; });
+
+  // the top goes to the next key of its list (or is removed), then sifts down: one pass instead of a pop and a push
+  auto advance_top = [&] () {
+    int l = heap[0].list;
+    if (++pos[l] < sizes[l]) {
+      heap[0].key = keys[l][pos[l]];
+    } else {
+      heap[0] = heap.back();
+      heap.pop_back();
+    }
+    size_t i = 0, n = heap.size();
+    while (2 * i + 1 < n) {
+      size_t c = 2 * i + 1;
+      if (c + 1 < n && heap[c + 1].key < heap[c].key) c++;
+      if (!(heap[c].key < heap[i].key)) break;
+      std::swap(heap[i], heap[c]);
+      i = c;
+    }
+  };
+
+  while (!heap.empty()) {
+    Key key = heap[0].key;
+    int n_lists = 0;
+    long noise_sum = 0;
+    while (!heap.empty() && heap[0].key == key) {
+      n_lists++;
+      noise_sum += noise[heap[0].list][pos[heap[0].list]];
+      advance_top();
+    }
+    f(key, n_lists, noise_sum);
+  }
+  return;
+}
+
+// changes from one noise map to the next: upserts are the new pixels and the pixels whose noise level changed,
+// removed are the disappeared pixels (both sorted by key)
+template <typename Key>
+struct noise_map_delta
+{
+  std::vector<Key> upsert_keys;
+  std::vector<int> upsert_noise;
+  std::vector<Key> removed_keys;
+};
+
+template <typename G>
+noise_map_delta<typename G::key_type> make_noise_map_delta (const basic_noise_map<G>& curr, const basic_noise_map<G>& prev)
+{
+  noise_map_delta<typename G::key_type> delta;
+  size_t i_curr = 0, i_prev = 0;
+  while (i_curr < curr.size() || i_prev < prev.size())
+  {
+    if (i_prev == prev.size() || (i_curr < curr.size() && curr.keys[i_curr] < prev.keys[i_prev])) {
+      delta.upsert_keys.push_back(curr.keys[i_curr]);
+      delta.upsert_noise.push_back(curr.noise[i_curr++]);
+    } else if (i_curr == curr.size() || prev.keys[i_prev] < curr.keys[i_curr]) {
+      delta.removed_keys.push_back(prev.keys[i_prev++]);
+    } else {
+      if (curr.noise[i_curr] != prev.noise[i_prev]) {
+        delta.upsert_keys.push_back(curr.keys[i_curr]);
+        delta.upsert_noise.push_back(curr.noise[i_curr]);
+      }
+      i_curr++;
+      i_prev++;
+    }
+  }
+  return delta;
+}
+
+// prev + delta -> the next map
+template <typename G>
+void apply_noise_map_delta (const basic_noise_map<G>& prev, const noise_map_delta<typename G::key_type>& delta, 
+  basic_noise_map<G>& next)
+{
+  next.keys.clear();
+  next.noise.clear();
+  next.keys.reserve(prev.size() + delta.upsert_keys.size());
+  next.noise.reserve(prev.size() + delta.upsert_keys.size());
+  size_t i_prev = 0, i_up = 0, i_rm = 0;
+  while (i_prev < prev.size() || i_up < delta.upsert_keys.size())
+  {
+    if (i_prev == prev.size() || (i_up < delta.upsert_keys.size() && delta.upsert_keys[i_up] <= prev.keys[i_prev])) {
+      if (i_prev < prev.size() && delta.upsert_keys[i_up] == prev.keys[i_prev]) i_prev++; // noise level changed
+      next.keys.push_back(delta.upsert_keys[i_up]);
+      next.noise.push_back(delta.upsert_noise[i_up++]);
+    } else {
+      while (i_rm < delta.removed_keys.size() && delta.removed_keys[i_rm] < prev.keys[i_prev]) i_rm++;
+      if (i_rm == delta.removed_keys.size() || delta.removed_keys[i_rm] != prev.keys[i_prev]) {
+        next.keys.push_back(prev.keys[i_prev]);
+        next.noise.push_back(prev.noise[i_prev]);
+      }
+      i_prev++;
+    }
+  }
+}
+
+// history of consecutive noise maps in one append-only file (noise_maps/history.nmh):
+// a full checkpoint every checkpoint_interval records, deltas to the previous record in between;
+// any run is reconstructed by replaying the deltas from the nearest checkpoint before it
+// record: header, keys[n_keys], int32 noise[n_keys], removed keys[n_removed] (keys of the map type)
+// (a checkpoint has the full map in keys/noise and no removed keys)
+struct history_record_header
+{
+  char magic[4] = {'N', 'M', 'H', 'R'};
+  int32_t is_checkpoint = 0;
+  int32_t run = -1;
+  uint32_t n_keys = 0;
+  uint32_t n_removed = 0;
+};
+
+template <typename M>
+class basic_noise_map_history
+{
+ public:
+  typedef M noise_map;
+  typedef typename M::key_type key_type;
+  typedef noise_map_delta<key_type> delta_type;
+
+  // reads the record headers (the maps themselves are only read when reconstructed)
+  bool open (std::string fname, int checkpoint_interval = 20)
+  {
+    mFname = fname;
+    mCheckpointInterval = std::max(1, checkpoint_interval);
+    mRecords.clear();
+    FILE* f = std::fopen(fname.data(), "rb");
+    if (!f) return true; // new history
+    history_record_header h;
+    long offset = 0;
+    while (std::fread(&h, sizeof(h), 1, f) == 1) {
+      long size = sizeof(h) + (long)h.n_keys * (sizeof(key_type) + 4) + (long)h.n_removed * sizeof(key_type);
+      if (h.magic[0] != 'N' || h.magic[1] != 'M' || h.magic[2] != 'H' || h.magic[3] != 'R' 
+        || std::fseek(f, offset + size, SEEK_SET) != 0 || offset + size > file_size(f)) break;
+      mRecords.push_back({h.run, h.is_checkpoint != 0, offset});
+      offset += size;
+    }
+    bool truncated = offset < file_size(f);
+    std::fclose(f);
+    if (truncated) { // interrupted append: drop the incomplete record
+      std::cout << "Dropping an incomplete record at the end of " << fname << "\n";
+      if (::truncate(fname.data(), offset) != 0) return false;
+    }
+    return true;
+  }
+
+  // appends the current map of a step: as a delta to prev if prev is the last stored run,
+  // otherwise (or every checkpoint_interval records) as a checkpoint; runs already stored are skipped
+  bool append (const noise_map& curr, const noise_map& prev)
+  {
+    if (find(curr.run) >= 0) return true;
+    if (mRecords.empty() && prev.run >= 0 && !write_record(prev, nullptr)) return false;
+    bool is_checkpoint = mRecords.empty() || mRecords.back().run != prev.run 
+      || (int)(mRecords.size() - last_checkpoint(mRecords.size() - 1)) >= mCheckpointInterval;
+    if (is_checkpoint) return write_record(curr, nullptr);
+    delta_type delta = make_noise_map_delta(curr, prev);
+    return write_record(curr, &delta);
+  }
+
+  bool reconstruct (int run, noise_map& m)
+  {
+    int i = find(run);
+    if (i < 0) return false;
+    FILE* f = std::fopen(mFname.data(), "rb");
+    if (!f) return false;
+    bool ok = true;
+    noise_map prev;
+    for (int j = last_checkpoint(i); ok && j <= i; j++) {
+      delta_type delta;
+      ok = read_record(f, mRecords[j], prev, delta);
+      if (ok && !mRecords[j].is_checkpoint) {
+        noise_map next;
+        apply_noise_map_delta(prev, delta, next);
+        std::swap(prev, next);
+      }
+      prev.run = mRecords[j].run;
+    }
+    std::fclose(f);
+    if (ok) m = std::move(prev);
+    else std::cout << "Cannot reconstruct run " << run << " from " << mFname << "\n";
+    return ok;
+  }
+
+  std::vector<int> runs () const
+  {
+    std::vector<int> r;
+    for (auto const& rec : mRecords) r.push_back(rec.run);
+    return r;
+  }
+
+  long file_size () const
+  {
+    FILE* f = std::fopen(mFname.data(), "rb");
+    if (!f) return 0;
+    long size = file_size(f);
+    std::fclose(f);
+    return size;
+  }
+
+ private:
+  struct record
+  {
+    int run;
+    bool is_checkpoint;
+    long offset;
+  };
+
+  static long file_size (FILE* f)
+  {
+    long pos = std::ftell(f);
+    std::fseek(f, 0, SEEK_END);
+    long size = std::ftell(f);
+    std::fseek(f, pos, SEEK_SET);
+    return size;
+  }
+
+  int find (int run) const
+  {
+    for (int i = (int)mRecords.size() - 1; i >= 0; i--) if (mRecords[i].run == run) return i;
+    return -1;
+  }
+
+  int last_checkpoint (int i) const
+  {
+    while (i > 0 && !mRecords[i].is_checkpoint) i--;
+    return i;
+  }
+
+  // delta == nullptr: checkpoint of m
+  bool write_record (const noise_map& m, const delta_type* delta)
+  {
+    FILE* f = std::fopen(mFname.data(), "ab");
+    if (!f) {
+      std::cout << "Cannot open " << mFname << "\n";
+      return false;
+    }
+    long offset = file_size(f);
+    history_record_header h;
+    h.is_checkpoint = delta == nullptr;
+    h.run = m.run;
+    const std::vector<key_type>& keys = delta ? delta->upsert_keys : m.keys;
+    const std::vector<int>& noise = delta ? delta->upsert_noise : m.noise;
+    h.n_keys = keys.size();
+    h.n_removed = delta ? delta->removed_keys.size() : 0;
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && std::fwrite(keys.data(), sizeof(key_type), h.n_keys, f) == h.n_keys;
+    ok = ok && std::fwrite(noise.data(), sizeof(int32_t), h.n_keys, f) == h.n_keys;
+    if (delta) ok = ok && std::fwrite(delta->removed_keys.data(), sizeof(key_type), h.n_removed, f) == h.n_removed;
+    ok = (std::fclose(f) == 0) && ok;
+    if (ok) mRecords.push_back({m.run, delta == nullptr, offset});
+    else std::cout << "Cannot write " << mFname << "\n";
+    return ok;
+  }
+
+  // a checkpoint is read into m, a delta into delta
+  bool read_record (FILE* f, const record& rec, noise_map& m, delta_type& delta)
+  {
+    history_record_header h;
+    if (std::fseek(f, rec.offset, SEEK_SET) != 0 || std::fread(&h, sizeof(h), 1, f) != 1) return false;
+    std::vector<key_type>& keys = rec.is_checkpoint ? m.keys : delta.upsert_keys;
+    std::vector<int>& noise = rec.is_checkpoint ? m.noise : delta.upsert_noise;
+    keys.resize(h.n_keys);
+    noise.resize(h.n_keys);
+    delta.removed_keys.resize(h.n_removed);
+    return std::fread(keys.data(), sizeof(key_type), h.n_keys, f) == h.n_keys
+      && std::fread(noise.data(), sizeof(int32_t), h.n_keys, f) == h.n_keys
+      && std::fread(delta.removed_keys.data(), sizeof(key_type), h.n_removed, f) == h.n_removed;
+  }
+
+  std::string mFname;
+  int mCheckpointInterval = 20;
+  std::vector<record> mRecords; // in the order of the file
+};
+
+typedef basic_noise_map_history<noise_map> noise_map_history;
+
+// MFT layout: the chipIDs are ordered by half, then by disk (half-disk = half * N_disks + disk)
+const int N_halves = 2;
+const int N_disks = 5;
+const int N_half_disks = N_halves * N_disks;
+constexpr int N_chips_per_half_disk[N_disks] = {66, 66, 82, 118, 136};
+
+constexpr int half_disk_first_chip (int half_disk)
+{
+  int chip = 0;
+  for (int i = 0; i < half_disk; i++) chip += N_chips_per_half_disk[i % N_disks];
+  return chip;
+}
+static_assert(half_disk_first_chip(N_half_disks) == N_chips, "MFT layout does not match the number of chips");
+
+int chip_half_disk (int chip)
+{
+  int half_disk = 0;
+  while (half_disk + 1 < N_half_disks && chip >= half_disk_first_chip(half_disk + 1)) half_disk++;
+  return half_disk;
+}
+
+// total, new and disappeared noisy pixels of every chip for a sequence of runs (runs x quantities x chips, dense)
+// file (<folder>/chip_counts.ncm): header, then one row per run: int32 run, int32 counts[N_chip_quantities][n_chips];
+// rows are only appended, an incomplete last row (interrupted append) is ignored
+enum chip_quantity { chip_total, chip_new, chip_disapp, N_chip_quantities };
+const char* const chip_quantity_names[N_chip_quantities] = {"total", "new", "disappeared"};
+
+struct chip_matrix_header
+{
+  char magic[4] = {'N', 'C', 'M', 'X'};
+  uint32_t version = 1;
+  int32_t n_chips = 0;
+};
+
+class chip_matrix
+{
+ public:
+  chip_matrix (int n_chips = N_chips) : mNChips(n_chips) {}
+
+  int n_chips () const { return mNChips; }
+  size_t n_runs () const { return mRuns.size(); }
+  const std::vector<int>& runs () const { return mRuns; }
+
+  // counts of all chips in run i (contiguous)
+  const int32_t* row (size_t i, int q) const { return &mCounts[(i * N_chip_quantities + q) * mNChips]; }
+  int32_t count (size_t i, int q, int chip) const { return row(i, q)[chip]; }
+
+  std::vector<int> chip_history (int chip, int q) const
+  {
+    std::vector<int> counts(n_runs());
+    for (size_t i = 0; i < n_runs(); i++) counts[i] = count(i, q, chip);
+    return counts;
+  }
+
+  void add_run (int run, const noise_map_diff& diff)
+  {
+    mRuns.push_back(run);
+    for (const std::vector<int>* counts : {&diff.chip_total, &diff.chip_new, &diff.chip_disapp}) {
+      mCounts.insert(mCounts.end(), counts->begin(), counts->begin() + mNChips);
+    }
+  }
+
+  // keeps the first n runs
+  void truncate (size_t n)
+  {
+    if (n >= n_runs()) return;
+    mRuns.resize(n);
+    mCounts.resize(n * N_chip_quantities * mNChips);
+  }
+
+  // true also if the file does not exist yet (empty matrix)
+  bool read (std::string fname)
+  {
+    mRuns.clear();
+    mCounts.clear();
+    FILE* f = std::fopen(fname.data(), "rb");
+    if (!f) return true;
+    chip_matrix_header h;
+    bool ok = std::fread(&h, sizeof(h), 1, f) == 1 && std::memcmp(h.magic, chip_matrix_header().magic, 4) == 0
+      && h.version == chip_matrix_header().version && h.n_chips == mNChips;
+    size_t row_size = N_chip_quantities * mNChips;
+    int32_t run;
+    while (ok && std::fread(&run, sizeof(run), 1, f) == 1) {
+      mCounts.resize(mCounts.size() + row_size);
+      if (std::fread(&mCounts[mCounts.size() - row_size], sizeof(int32_t), row_size, f) != row_size) {
+        mCounts.resize(mCounts.size() - row_size);
+        break;
+      }
+      mRuns.push_back(run);
+    }
+    std::fclose(f);
+    if (!ok) std::cout << "Corrupted chip matrix file " << fname << "\n";
+    return ok;
+  }
+
+  // appends the runs [first, n_runs) to the file (as rows after the first ones), the header if the file is new
+  bool append (std::string fname, size_t first)
+  {
+    FILE* f = std::fopen(fname.data(), "r+b");
+    if (!f) f = std::fopen(fname.data(), "w+b");
+    if (!f) {
+      std::cout << "Cannot open " << fname << "\n";
+      return false;
+    }
+    chip_matrix_header h;
+    h.n_chips = mNChips;
+    size_t row_size = N_chip_quantities * mNChips;
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1 
+      && std::fseek(f, sizeof(h) + first * (sizeof(int32_t) + row_size * sizeof(int32_t)), SEEK_SET) == 0;
+    for (size_t i = first; ok && i < n_runs(); i++) {
+      ok = std::fwrite(&mRuns[i], sizeof(int32_t), 1, f) == 1
+        && std::fwrite(row(i, 0), sizeof(int32_t), row_size, f) == row_size;
+    }
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok) std::cout << "Cannot write " << fname << "\n";
+    return ok;
+  }
+
+ private:
+  int mNChips;
+  std::vector<int> mRuns;
+  std::vector<int32_t> mCounts;
+};
+
+// counts of one quantity summed per half-disk, disk and half, for all runs (n_runs x N_half_disks etc.)
+// the chips of a half-disk are contiguous: plain branch-free sums over int32 ranges, vectorized by the compiler
+struct layout_counts
+{
+  std::vector<int> half_disk, disk, half;
+};
+
+layout_counts aggregate_layout (const chip_matrix& m, int q)
+{
+  layout_counts sums;
+  if (m.n_chips() != N_chips) {
+    std::cout << "Chip matrix does not have the MFT layout\n";
+    return sums;
+  }
+  size_t n_runs = m.n_runs();
+  sums.half_disk.resize(n_runs * N_half_disks);
+  sums.disk.resize(n_runs * N_disks);
+  sums.half.resize(n_runs * N_halves);
+  for (size_t i = 0; i < n_runs; i++) {
+    const int32_t* counts = m.row(i, q);
+    int* hd = &sums.half_disk[i * N_half_disks];
+    for (int j = 0; j < N_half_disks; j++) {
+      int sum = 0;
+      for (int chip = half_disk_first_chip(j), end = half_disk_first_chip(j + 1); chip < end; chip++) sum += counts[chip];
+      hd[j] = sum;
+    }
+    for (int d = 0; d < N_disks; d++) sums.disk[i * N_disks + d] = hd[d] + hd[N_disks + d];
+    for (int h = 0; h < N_halves; h++) {
+      int sum = 0;
+      for (int d = 0; d < N_disks; d++) sum += hd[h * N_disks + d];
+      sums.half[i * N_halves + h] = sum;
+    }
+  }
+  return sums;
+}
+
+// clusters of noisy pixels: groups of pixels of one chip connected by an edge or a corner
+// size distribution in bins 1, 2, 3-4, 5-8, 9-16, >16 pixels
+const int N_cluster_bins = 6;
+
+struct noise_map_clusters
+{
+  int n_clusters = 0;
+  int max_size = 0;
+  std::vector<int> size_bins = std::vector<int>(N_cluster_bins, 0);
+
+  void add (int size)
+  {
+    n_clusters++;
+    max_size = std::max(max_size, size);
+    int bin = 0;
+    while (bin < N_cluster_bins - 1 && size > (1 << bin)) bin++;
+    size_bins[bin]++;
+  }
+
+  void add (const noise_map_clusters& other)
+  {
+    n_clusters += other.n_clusters;
+    max_size = std::max(max_size, other.max_size);
+    for (int i = 0; i < N_cluster_bins; i++) size_bins[i] += other.size_bins[i];
+  }
+};
+
+// union-find over the pixels keys[begin, end) of one chip: the keys are ordered by row and col,
+// so the neighbours in the previous row are found by a pointer that only moves forward
+template <typename Key>
+void find_chip_clusters (const Key* keys, size_t begin, size_t end, std::vector<int>& parent, noise_map_clusters& clusters)
+{
+  int n = end - begin;
+  parent.resize(n);
+  for (int i = 0; i < n; i++) parent[i] = i;
+  auto root = [&] (int i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  auto join = [&] (int i, int j) {
+    i = root(i);
+    j = root(j);
+    if (i != j) parent[std::max(i, j)] = std::min(i, j);
+  };
+  int chip = key_chip(keys[begin]);
+  size_t prev_row = begin; // first pixel which can touch the current one from the previous row
+  for (size_t i = begin; i < end; i++) {
+    int row = key_row(keys[i]);
+    int col = key_col(keys[i]);
+    if (i > begin && keys[i-1] == keys[i] - 1 && col > 0) join(i - begin, i - 1 - begin); // left
+    if (row == 0) continue;
+    Key first = pixel_key<Key>(chip, row - 1, std::max(col - 1, 0));
+    Key last = pixel_key<Key>(chip, row - 1, std::min(col + 1, 0x3ff));
+    while (prev_row < i && keys[prev_row] < first) prev_row++;
+    for (size_t j = prev_row; j < i && keys[j] <= last; j++) join(i - begin, j - begin);
+  }
+  // size of each cluster, counted at its root (the roots come first)
+  std::vector<int> size(n, 0);
+  for (int i = 0; i < n; i++) size[root(i)]++;
+  for (int i = 0; i < n; i++) if (size[i]) clusters.add(size[i]);
+  return;
+}
+
+// clusters of all chips of a sorted key array; the chips are split into n_threads ranges of similar pixel counts
+// (small maps are done in the calling thread)
+template <typename Key>
+noise_map_clusters find_clusters (const Key* keys, size_t n, int n_threads = 4)
+{
+  std::vector<size_t> chip_begin; // first pixel of every chip with noisy pixels, then n
+  for (size_t i = 0; i < n; i++) if (i == 0 || key_chip(keys[i]) != key_chip(keys[i-1])) chip_begin.push_back(i);
+  chip_begin.push_back(n);
+  int n_chips = chip_begin.size() - 1;
+  n_threads = std::max(1, std::min({n_threads, n_chips, (int)(n / 20000) + 1}));
+
+  std::vector<noise_map_clusters> clusters(n_threads);
+  auto process = [&] (int t) {
+    std::vector<int> parent;
+    // chips whose first pixel falls in the t-th share of the pixels
+    size_t from = n * t / n_threads, to = n * (t + 1) / n_threads;
+    for (int c = 0; c < n_chips; c++) {
+      if (chip_begin[c] >= from && chip_begin[c] < to) {
+        find_chip_clusters(keys, chip_begin[c], chip_begin[c+1], parent, clusters[t]);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < n_threads; t++) threads.emplace_back(process, t);
+  process(0);
+  for (auto& th : threads) th.join();
+  for (int t = 1; t < n_threads; t++) clusters[0].add(clusters[t]);
+  return clusters[0];
+}
+
+template <typename G>
+noise_map_clusters find_clusters (const basic_noise_map<G>& m, int n_threads = 4)
+{
+  return find_clusters(m.keys.data(), m.size(), n_threads);
+}
+
+// stages of the counting pipeline: CCDB header lookup, object retrieval (download and deserialization),
+// decoding of a cached map, pixel scan, sort, cache write, reload of an evicted map, diff and clustering
+enum pipeline_stage { stage_lookup, stage_retrieve, stage_decode, stage_scan, stage_sort, stage_write, 
+  stage_reload, stage_diff, stage_clusters, N_stages };
+const char* const stage_names[N_stages] = {"lookup", "retrieve", "decode", "scan", "sort", "write", 
+  "reload", "diff", "clusters"};
+
+// time spent in each stage and bytes read/written per noise run, plus named counters (thread-safe)
+class pipeline_stats
+{
+ public:
+  struct run_stats
+  {
+    double seconds[N_stages] = {};
+    long bytes_read = 0;
+    long bytes_written = 0;
+  };
+
+  void add_time (int run, int stage, double seconds)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRuns[run].seconds[stage] += seconds;
+  }
+
+  void add_bytes (int run, long read, long written)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRuns[run].bytes_read += read;
+    mRuns[run].bytes_written += written;
+  }
+
+  void count (std::string name, long n = 1)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCounters[name] += n;
+  }
+
+  void clear ()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mRuns.clear();
+    mCounters.clear();
+  }
+
+  // nearest-rank percentile (in s) of a stage over the runs in which it ran
+  double percentile (int stage, double p)
+  {
+    std::vector<double> t = stage_times(stage);
+    if (t.empty()) return 0;
+    size_t rank = std::max(1., std::ceil(p / 100. * t.size()));
+    return t[std::min(rank, t.size()) - 1];
+  }
+
+  // one row per run: seconds per stage, bytes read and written
+  bool write_csv (std::string fname)
+  {
+    std::ofstream f(fname);
+    if (!f.is_open()) {
+      std::cout << "Cannot open " << fname << "\n";
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    f << "run";
+    for (int s = 0; s < N_stages; s++) f << "," << stage_names[s] << "_s";
+    f << ",bytes_read,bytes_written\n";
+    for (auto const& r : mRuns) {
+      f << r.first;
+      for (int s = 0; s < N_stages; s++) f << "," << r.second.seconds[s];
+      f << "," << r.second.bytes_read << "," << r.second.bytes_written << "\n";
+    }
+    return true;
+  }
+
+  // the same per run, plus the summary per stage and the counters
+  bool write_json (std::string fname)
+  {
+    std::ofstream f(fname);
+    if (!f.is_open()) {
+      std::cout << "Cannot open " << fname << "\n";
+      return false;
+    }
+    f << "{\n  \"runs\": [";
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      bool first = true;
+      for (auto const& r : mRuns) {
+        f << (first ? "\n" : ",\n") << "    {\"run\": " << r.first;
+        for (int s = 0; s < N_stages; s++) f << ", \"" << stage_names[s] << "\": " << r.second.seconds[s];
+        f << ", \"bytes_read\": " << r.second.bytes_read << ", \"bytes_written\": " << r.second.bytes_written << "}";
+        first = false;
+      }
+    }
+    f << "\n  ],\n  \"stages\": {";
+    for (int s = 0; s < N_stages; s++) {
+      std::vector<double> t = stage_times(s);
+      f << (s ? ",\n" : "\n") << "    \"" << stage_names[s] << "\": {\"n\": " << t.size() 
+        << ", \"total\": " << sum(t) << ", \"p50\": " << percentile(s, 50) << ", \"p90\": " << percentile(s, 90) 
+        << ", \"p99\": " << percentile(s, 99) << ", \"max\": " << (t.empty() ? 0 : t.back()) << "}";
+    }
+    f << "\n  },\n  \"counters\": {";
+    std::lock_guard<std::mutex> lock(mMutex);
+    bool first = true;
+    for (auto const& c : mCounters) {
+      f << (first ? "\n" : ",\n") << "    \"" << c.first << "\": " << c.second;
+      first = false;
+    }
+    f << "\n  }\n}\n";
+    return true;
+  }
+
+  void print_summary ()
+  {
+    std::cout << "Stage       runs    total [s]   p50 [ms]   p90 [ms]   p99 [ms]   max [ms]\n";
+    for (int s = 0; s < N_stages; s++) {
+      std::vector<double> t = stage_times(s);
+      if (t.empty()) continue;
+      std::cout << Form("%-10s %5lu %12.2f %10.1f %10.1f %10.1f %10.1f\n", stage_names[s], t.size(), sum(t), 
+        1e3 * percentile(s, 50), 1e3 * percentile(s, 90), 1e3 * percentile(s, 99), 1e3 * t.back());
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    long bytes_read = 0, bytes_written = 0;
+    for (auto const& r : mRuns) {
+      bytes_read += r.second.bytes_read;
+      bytes_written += r.second.bytes_written;
+    }
+    std::cout << "Read: " << bytes_read / 1e6 << " MB, written: " << bytes_written / 1e6 << " MB\n";
+    for (auto const& c : mCounters) std::cout << c.first << ": " << c.second << "\n";
+  }
+
+ private:
+  // sorted times of a stage over the runs in which it ran
+  std::vector<double> stage_times (int stage)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<double> t;
+    for (auto const& r : mRuns) if (r.second.seconds[stage] > 0) t.push_back(r.second.seconds[stage]);
+    std::sort(t.begin(), t.end());
+    return t;
+  }
+
+  static double sum (const std::vector<double>& v)
+  {
+    double s = 0;
+    for (double x : v) s += x;
+    return s;
+  }
+
+  std::mutex mMutex;
+  std::map<int, run_stats> mRuns;
+  std::map<std::string, long> mCounters;
+};
+
+// adds the time between its construction and destruction to a stage of a run
+// (the run can be set later, e.g. once the headers of the map are known; if it never is, nothing is added)
+class scoped_timer
+{
+ public:
+  scoped_timer (pipeline_stats& stats, int stage, int run = -1)
+    : run(run), mStats(stats), mStage(stage), mStart(std::chrono::steady_clock::now()) {}
+  ~scoped_timer ()
+  {
+    if (run < 0) return;
+    mStats.add_time(run, mStage, std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count());
+  }
+  scoped_timer (const scoped_timer&) = delete;
+  scoped_timer& operator= (const scoped_timer&) = delete;
+
+  int run;
+
+ private:
+  pipeline_stats& mStats;
+  int mStage;
+  std::chrono::steady_clock::time_point mStart;
+};
+
+#endif